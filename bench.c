@@ -0,0 +1,823 @@
+/* This file is part of clipsim.
+ * Copyright (C) 2023 Lucas Mior
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Micro benchmarks for the content and history hot paths, built by
+ * `make bench` from the daemon sources. Results are printed one per line
+ * in the format of go test -bench, so they can be compared between
+ * releases with benchstat:
+ *
+ *   BenchmarkName/corpus/size  iterations  ns/op  [MB/s]  allocs/op
+ *
+ * MB/s is given for the content benchmarks that scan all their input.
+ * The largest content size is run once for each dispatch level of the
+ * kernels this CPU has, with the level appended to the name.
+ * Allocations are the calls to malloc, calloc and realloc made by
+ * clipsim itself (the binary is linked with --wrap for them). History
+ * benchmarks run in a temporary $XDG_CACHE_HOME under $TMPDIR, so
+ * they include the cost of syncing the journal to that disk.
+ *
+ * Before any of them, bench_check compares a few results against what
+ * they must be, and every dispatch level against the scalar kernels,
+ * so that a broken limit or kernel fails `make bench` instead of being
+ * timed. Failures are printed as "--- FAIL:" lines. */
+
+#include "clipsim.h"
+
+#define BENCH_TIME_NS 200000000ull
+#define BENCH_MAX_ITERATIONS 100000000ull
+#define CORPUS_SIZE (4*1024*1024)
+#define LARGE_TEXT_SIZE 300000
+#define CHECK_TRIALS 20000
+#define CHECK_MAX_LENGTH (TRIMMED_SIZE + 96)
+
+typedef enum Corpus {
+    CORPUS_PROSE = 0,
+    CORPUS_CODE,
+    CORPUS_SPACES,
+    CORPUS_PNG,
+    CORPUS_BINARY,
+    CORPUS_NEWLINES,
+    CORPUS_LAST,
+} Corpus;
+
+typedef struct Text {
+    char *data;
+    int length;
+    int unused;
+} Text;
+
+const char TEXT_TAG = (char) 0x01;
+const char IMAGE_TAG = (char) 0x02;
+mtx_t lock;
+char *program = "clipsim-bench";
+
+static const char *corpus_names[CORPUS_LAST] = {
+    [CORPUS_PROSE]  = "prose",
+    [CORPUS_CODE]   = "code",
+    [CORPUS_SPACES] = "spaces",
+    [CORPUS_PNG]    = "png",
+    [CORPUS_BINARY] = "binary",
+    [CORPUS_NEWLINES] = "newlines",
+};
+static const char *kernel_names[CONTENT_KERNELS_LAST] = {
+    [CONTENT_KERNELS_SCALAR] = "scalar",
+    [CONTENT_KERNELS_SSE2]   = "sse2",
+    [CONTENT_KERNELS_AVX2]   = "avx2",
+};
+static const int text_sizes[] = { 64, 1024, BUFSIZ - 1, CORPUS_SIZE };
+static const int32 history_sizes[] = { 128, 1000, 10000 };
+static const int compression_levels[] = { 0, 1, 6 };
+
+static char *corpora[CORPUS_LAST];
+static usize allocations = 0;
+static usize stop_allocations;
+static uint64 start_time;
+static uint64 stop_time;
+static uint64 random_state = 0x2545f4914f6cdd1dull;
+static uint64 unique = 0;
+static const char *filter = NULL;
+static char cache_home[PATH_MAX];
+static usize file_bytes;
+static usize text_bytes;
+
+void *__real_malloc(usize);
+void *__real_calloc(usize, usize);
+void *__real_realloc(void *, usize);
+void *__wrap_malloc(usize);
+void *__wrap_calloc(usize, usize);
+void *__wrap_realloc(void *, usize);
+
+static uint64 bench_now(void);
+static uint64 bench_random(void);
+static void bench_reset_timer(void);
+static void bench_stop_timer(void);
+static void bench_run(const char *, void (*)(usize, void *), void *);
+static void bench_corpus(Corpus);
+static Text *bench_texts(usize, int);
+static void bench_free_texts(Text *, usize);
+static void bench_history_open(int32);
+static void bench_history_fill(int32);
+static void bench_compression(int);
+static void bench_check(void);
+static void bench_check_large_text(void);
+static void bench_check_kernels(void);
+static void bench_check_same(int32, char *, int, int);
+static void bench_content(const char *, Text *);
+static void bench_trim_spaces(usize, void *);
+static void bench_check_content(usize, void *);
+static void bench_remove_newline(usize, void *);
+static void bench_append_unique(usize, void *);
+static void bench_append_repeated(usize, void *);
+static void bench_repeated_index(usize, void *);
+static void bench_history_view(usize, void *);
+static void bench_search(usize, void *);
+static void bench_trigram_find(usize, void *);
+static void bench_history_save(usize, void *);
+static void bench_history_read(usize, void *);
+
+void *
+__wrap_malloc(usize size) {
+    allocations += 1;
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(usize nmemb, usize size) {
+    allocations += 1;
+    return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void *old, usize size) {
+    allocations += 1;
+    return __real_realloc(old, size);
+}
+
+void
+clipboard_own(const char *data, const usize length, const bool image) {
+    (void) data;
+    (void) length;
+    (void) image;
+    return;
+}
+
+int main(int argc, char *argv[]) {
+    char name[128];
+    int null;
+
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [benchmark name filter]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (argc == 2)
+        filter = argv[1];
+
+    /* history_append takes the lock, like in the daemon */
+    if (mtx_init(&lock, mtx_plain) != thrd_success) {
+        fprintf(stderr, "Error initializing lock.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (Corpus c = 0; c < CORPUS_LAST; c += 1) {
+        corpora[c] = util_malloc(CORPUS_SIZE + 1);
+        bench_corpus(c);
+    }
+
+    {
+        const char *TMPDIR = getenv("TMPDIR");
+        int n = snprintf(cache_home, sizeof (cache_home),
+                         "%s/clipsim-bench.XXXXXX", TMPDIR ? TMPDIR : "/tmp");
+        if ((n < 0) || (n >= (int) sizeof (cache_home))) {
+            fprintf(stderr, "TMPDIR is too long.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (mkdtemp(cache_home) == NULL) {
+            fprintf(stderr, "Error creating %s: %s\n",
+                            cache_home, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        setenv("XDG_CACHE_HOME", cache_home, 1);
+    }
+
+    /* dedup and compaction report to stderr on the measured paths */
+    if ((null = open("/dev/null", O_WRONLY)) >= 0) {
+        dup2(null, STDERR_FILENO);
+        close(null);
+    }
+
+    bench_check();
+
+    for (Corpus c = 0; c < CORPUS_LAST; c += 1) {
+        for (uint i = 0; i < LENGTH(text_sizes); i += 1) {
+            Text text = { .data = corpora[c], .length = text_sizes[i] };
+            char corpus[64];
+            if ((c == CORPUS_PNG || c == CORPUS_BINARY)
+                && (text_sizes[i] != 1024)) {
+                continue;
+            }
+
+            snprintf(corpus, sizeof (corpus),
+                     "%s/%d", corpus_names[c], text.length);
+            if (text.length < CORPUS_SIZE) {
+                bench_content(corpus, &text);
+                continue;
+            }
+
+            /* ends on the best level, which the daemon uses */
+            for (int32 k = 0; k < CONTENT_KERNELS_LAST; k += 1) {
+                char level[96];
+                if (!content_use_kernels(k))
+                    continue;
+                snprintf(level, sizeof (level),
+                         "%s/%s", corpus, kernel_names[k]);
+                bench_content(level, &text);
+            }
+        }
+    }
+
+    for (uint i = 0; i < LENGTH(history_sizes); i += 1) {
+        int32 size = history_sizes[i];
+
+        bench_history_open(size);
+        bench_history_fill(size);
+
+        snprintf(name, sizeof (name), "HistoryRepeatedIndex/%d", size);
+        bench_run(name, bench_repeated_index, &size);
+        snprintf(name, sizeof (name), "HistoryView/%d", size);
+        bench_run(name, bench_history_view, &size);
+        snprintf(name, sizeof (name), "SearchTop/%d", size);
+        bench_run(name, bench_search, &size);
+        snprintf(name, sizeof (name), "TrigramFind/%d", size);
+        bench_run(name, bench_trigram_find, &size);
+        snprintf(name, sizeof (name), "HistoryAppend/repeated/%d", size);
+        bench_run(name, bench_append_repeated, &size);
+        snprintf(name, sizeof (name), "HistoryAppend/unique/%d", size);
+        bench_run(name, bench_append_unique, &size);
+
+        /* the saved size is reported along the time it took */
+        for (uint l = 0; l < LENGTH(compression_levels); l += 1) {
+            char method[16] = "";
+            int level = compression_levels[l];
+
+            if (level)
+                snprintf(method, sizeof (method), "zlib-%d/", level);
+            bench_compression(level);
+            snprintf(name, sizeof (name), "HistorySave/%s%d", method, size);
+            bench_run(name, bench_history_save, &size);
+            snprintf(name, sizeof (name), "HistoryRead/%s%d", method, size);
+            bench_run(name, bench_history_read, &size);
+        }
+        bench_compression(0);
+
+        history_close();
+    }
+
+    {
+        char command[PATH_MAX + 16];
+        snprintf(command, sizeof (command), "rm -rf '%s'", cache_home);
+        if (system(command) != 0)
+            printf("# could not remove %s\n", cache_home);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+uint64
+bench_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64) t.tv_sec*1000000000ull + (uint64) t.tv_nsec;
+}
+
+/* xorshift64*, so that every run sees the same corpora */
+uint64
+bench_random(void) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state*0x2545f4914f6cdd1dull;
+}
+
+/* Exclude the setup done so far by a benchmark from its results. */
+void
+bench_reset_timer(void) {
+    allocations = 0;
+    stop_time = 0;
+    start_time = bench_now();
+    return;
+}
+
+/* Exclude what is left for a benchmark to do, like releasing its input. */
+void
+bench_stop_timer(void) {
+    stop_allocations = allocations;
+    stop_time = bench_now();
+    return;
+}
+
+/* Grow the number of iterations until a run takes BENCH_TIME_NS. */
+void
+bench_run(const char *name, void (*function)(usize, void *), void *arg) {
+    usize iterations = 1;
+    uint64 elapsed;
+
+    if (filter && !strstr(name, filter))
+        return;
+    file_bytes = 0;
+    text_bytes = 0;
+
+    while (true) {
+        bench_reset_timer();
+        function(iterations, arg);
+        if (stop_time == 0)
+            bench_stop_timer();
+        elapsed = stop_time - start_time;
+
+        if ((elapsed >= BENCH_TIME_NS) || (iterations >= BENCH_MAX_ITERATIONS))
+            break;
+
+        {
+            uint64 per_op = MAX(elapsed / iterations, 1);
+            uint64 next = (BENCH_TIME_NS + BENCH_TIME_NS/5) / per_op;
+            next = MIN(MAX(next, iterations + 1), iterations*100);
+            iterations = (usize) MIN(next, BENCH_MAX_ITERATIONS);
+        }
+    }
+
+    printf("Benchmark%s\t%zu\t%.1f ns/op", name, iterations,
+           (double) elapsed / (double) iterations);
+    if (text_bytes) {
+        printf("\t%.2f MB/s", (double) text_bytes*(double) iterations*1000.0
+                              / (double) MAX(elapsed, 1));
+    }
+    printf("\t%.2f allocs/op", (double) stop_allocations / (double) iterations);
+    if (file_bytes)
+        printf("\t%zu file-bytes", file_bytes);
+    printf("\n");
+    fflush(stdout);
+    return;
+}
+
+void
+bench_corpus(Corpus c) {
+    char *p = corpora[c];
+    char *end = corpora[c] + CORPUS_SIZE;
+    const char *words = "abcdefghijklmnopqrstuvwxyz";
+
+    switch (c) {
+    case CORPUS_PROSE:
+        /* words separated by single spaces, a line break now and then */
+        while (p < end) {
+            int word = 2 + (int) (bench_random() % 8);
+            for (int i = 0; (i < word) && (p < end); i += 1)
+                *p++ = words[bench_random() % 26];
+            if (p < end)
+                *p++ = (bench_random() % 12) ? ' ' : '\n';
+        }
+        break;
+    case CORPUS_CODE:
+        /* indented lines of short tokens */
+        while (p < end) {
+            int indent = 4*(int) (bench_random() % 4);
+            int tokens = 1 + (int) (bench_random() % 6);
+            for (int i = 0; (i < indent) && (p < end); i += 1)
+                *p++ = ' ';
+            for (int t = 0; t < tokens; t += 1) {
+                int token = 1 + (int) (bench_random() % 7);
+                for (int i = 0; (i < token) && (p < end); i += 1)
+                    *p++ = "abcxyz_(){};=+0123"[bench_random() % 18];
+                if (p < end)
+                    *p++ = ' ';
+            }
+            if (p < end)
+                *p++ = '\n';
+        }
+        break;
+    case CORPUS_SPACES:
+        /* long runs of mixed white space between words */
+        while (p < end) {
+            int run = 1 + (int) (bench_random() % 16);
+            for (int i = 0; (i < run) && (p < end); i += 1)
+                *p++ = " \t\n"[bench_random() % 3];
+            for (int i = 0; (i < 4) && (p < end); i += 1)
+                *p++ = words[bench_random() % 26];
+        }
+        break;
+    case CORPUS_PNG:
+        memcpy(p, "\x89PNG\r\n\x1a\n", 8);
+        for (p += 8; p < end; p += 1)
+            *p = (char) bench_random();
+        break;
+    case CORPUS_BINARY:
+        /* invalid UTF-8, so that it goes all the way to libmagic */
+        for (; p < end; p += 1)
+            *p = (char) (bench_random() | 0x80);
+        corpora[c][0] = (char) 0xff;
+        break;
+    case CORPUS_NEWLINES:
+        /* white space only, so the kernels scan all of it */
+        memset(p, '\n', CORPUS_SIZE);
+        corpora[c][CORPUS_SIZE] = '\0';
+        return;
+    default:
+        break;
+    }
+
+    /* text never starts or ends with white space in history */
+    corpora[c][0] = corpora[c][0] == ' ' ? 'a' : corpora[c][0];
+    for (uint i = 0; i < LENGTH(text_sizes); i += 1) {
+        if (IS_SPACE(corpora[c][text_sizes[i] - 1]))
+            corpora[c][text_sizes[i] - 1] = 'z';
+    }
+    corpora[c][CORPUS_SIZE] = '\0';
+    return;
+}
+
+/* Unique texts of a few hundred bytes, as history_append takes
+ * ownership of what it is given. */
+Text *
+bench_texts(usize count, int repeated) {
+    Text *texts = util_malloc(count*sizeof (*texts));
+
+    for (usize i = 0; i < count; i += 1) {
+        uint64 id = repeated > 0
+                    ? bench_random() % (uint64) repeated : unique++;
+        const char *prose = corpora[CORPUS_PROSE] + id % 512;
+        int length = 16 + (int) (id % 480);
+        int n;
+
+        texts[i].data = util_malloc((usize) length + 32);
+        n = snprintf(texts[i].data, 32, "%lu ", id);
+        memcpy(texts[i].data + n, prose, (usize) length);
+        texts[i].length = n + length;
+        while (IS_SPACE(texts[i].data[texts[i].length - 1]))
+            texts[i].length -= 1;
+        texts[i].data[texts[i].length] = '\0';
+    }
+    return texts;
+}
+
+void
+bench_free_texts(Text *texts, usize count) {
+    for (usize i = 0; i < count; i += 1)
+        free(texts[i].data);
+    free(texts);
+    return;
+}
+
+void
+bench_history_open(int32 size) {
+    char number[16];
+
+    snprintf(number, sizeof (number), "%d", size);
+    setenv("CLIPSIM_HISTORY_SIZE", number, 1);
+    history_close();
+    history_read();
+    return;
+}
+
+/* Entries with ids below size are the ones bench_texts repeats. */
+void
+bench_history_fill(int32 size) {
+    Text *texts;
+
+    unique = 0;
+    texts = bench_texts((usize) size, 0);
+    for (int32 i = 0; i < size; i += 1)
+        history_append(texts[i].data, texts[i].length, CLIPBOARD_TEXT);
+    free(texts);
+    history_save();
+    return;
+}
+
+/* Takes effect when the history is read again. */
+void
+bench_compression(int level) {
+    char number[16];
+
+    snprintf(number, sizeof (number), "%d", level);
+    setenv("CLIPSIM_COMPRESSION", number, 1);
+    history_close();
+    history_read();
+    return;
+}
+
+/* Exits on the first failure, telling which check failed. */
+void
+bench_check(void) {
+    bench_check_large_text();
+    bench_check_kernels();
+    return;
+}
+
+/* Text larger than BUFSIZ arrives over INCR and must be kept. */
+void
+bench_check_large_text(void) {
+    char *text = util_malloc(LARGE_TEXT_SIZE + 1);
+    int32 kind;
+
+    for (usize i = 0; i < LARGE_TEXT_SIZE; i += CORPUS_SIZE) {
+        memcpy(text + i, corpora[CORPUS_PROSE],
+               MIN(CORPUS_SIZE, LARGE_TEXT_SIZE - i));
+    }
+    text[LARGE_TEXT_SIZE] = '\0';
+
+    kind = content_check_content((uchar *) text, LARGE_TEXT_SIZE);
+    free(text);
+    if (kind != CLIPBOARD_TEXT) {
+        printf("--- FAIL: CheckLargeText: %d byte text classified as %d.\n",
+               LARGE_TEXT_SIZE, kind);
+        exit(EXIT_FAILURE);
+    }
+    return;
+}
+
+/* Random text, mostly white space or mostly words, at every start
+ * alignment within 64 bytes and with every tail of 0 to 63 bytes after
+ * the last vector, through the public functions that use the kernels.
+ * The corpora are made already, so the random state is given back for
+ * the texts the history benchmarks make. */
+void
+bench_check_kernels(void) {
+    char *buffer = util_malloc(64 + CHECK_MAX_LENGTH + 1);
+    uint64 saved_state = random_state;
+
+    for (int32 k = CONTENT_KERNELS_SCALAR + 1; k < CONTENT_KERNELS_LAST; k += 1) {
+        if (!content_use_kernels(k))
+            continue;
+
+        for (int trial = 0; trial < CHECK_TRIALS; trial += 1) {
+            int offset = trial % 64;
+            int length = 64*(int) (bench_random() % 5) + (trial / 64) % 64;
+            int spaces = (int) (bench_random() % 101);
+            int newlines = (int) (bench_random() % 4) ? 0
+                           : (int) (bench_random() % (uint64) (length + 1));
+            char *text = buffer + offset;
+
+            length = MIN(length, CHECK_MAX_LENGTH);
+            newlines = MIN(newlines, length);
+            for (int i = 0; i < length; i += 1) {
+                if ((int) (bench_random() % 100) < spaces)
+                    text[i] = " \t\n"[bench_random() % 3];
+                else
+                    text[i] = (char) ('a' + bench_random() % 26);
+            }
+            memset(text + length - newlines, '\n', (usize) newlines);
+            text[length] = '\0';
+
+            bench_check_same(k, text, length, offset);
+        }
+    }
+
+    /* back to the best level, which the daemon uses */
+    for (int32 k = 0; k < CONTENT_KERNELS_LAST; k += 1)
+        content_use_kernels(k);
+    random_state = saved_state;
+    free(buffer);
+    return;
+}
+
+/* Leaves the kernels of level in use. */
+void
+bench_check_same(int32 level, char *text, int length, int offset) {
+    char copies[2][CHECK_MAX_LENGTH + 1];
+    char *trimmed[2];
+    int trimmed_lengths[2];
+    int removed_lengths[2];
+    int32 kinds[2];
+    const char *failed = NULL;
+
+    for (int i = 0; i < 2; i += 1) {
+        content_use_kernels(i ? level : CONTENT_KERNELS_SCALAR);
+
+        content_trim_spaces(&trimmed[i], &trimmed_lengths[i], text, length);
+        kinds[i] = content_check_content((uchar *) text, length);
+
+        memcpy(copies[i], text, (usize) length + 1);
+        removed_lengths[i] = length;
+        content_remove_newline(copies[i], &removed_lengths[i]);
+    }
+
+    if ((trimmed_lengths[0] != trimmed_lengths[1])
+        || memcmp(trimmed[0], trimmed[1], (usize) trimmed_lengths[0] + 1)) {
+        failed = "ContentTrimSpaces";
+    } else if (kinds[0] != kinds[1]) {
+        failed = "ContentCheckContent";
+    } else if ((removed_lengths[0] != removed_lengths[1])
+               || memcmp(copies[0], copies[1], (usize) length + 1)) {
+        failed = "ContentRemoveNewline";
+    }
+
+    for (int i = 0; i < 2; i += 1) {
+        if (trimmed[i] != text)
+            util_slab_free(trimmed[i], (usize) trimmed_lengths[i] + 1);
+    }
+    if (failed) {
+        printf("--- FAIL: CheckKernels/%s: %s differs from scalar"
+               " for %d bytes at offset %d.\n",
+               kernel_names[level], failed, length, offset);
+        exit(EXIT_FAILURE);
+    }
+    return;
+}
+
+/* The trimmed copy never looks past TRIMMED_SIZE bytes, so its time
+ * stays flat with size, and only the newlines corpus has trailing
+ * newlines to strip. */
+void
+bench_content(const char *corpus, Text *text) {
+    char name[128];
+
+    snprintf(name, sizeof (name), "ContentCheckContent/%s", corpus);
+    bench_run(name, bench_check_content, text);
+    if (text->data == corpora[CORPUS_PNG]
+        || text->data == corpora[CORPUS_BINARY]) {
+        return;
+    }
+
+    snprintf(name, sizeof (name), "ContentTrimSpaces/%s", corpus);
+    bench_run(name, bench_trim_spaces, text);
+    if (text->data != corpora[CORPUS_NEWLINES])
+        return;
+
+    snprintf(name, sizeof (name), "ContentRemoveNewline/%s", corpus);
+    bench_run(name, bench_remove_newline, text);
+    return;
+}
+
+void
+bench_trim_spaces(usize iterations, void *arg) {
+    Text *text = arg;
+
+    for (usize i = 0; i < iterations; i += 1) {
+        char *trimmed;
+        int trimmed_length;
+
+        content_trim_spaces(&trimmed, &trimmed_length,
+                            text->data, text->length);
+        if (trimmed != text->data)
+            util_slab_free(trimmed, (usize) trimmed_length + 1);
+    }
+    return;
+}
+
+void
+bench_check_content(usize iterations, void *arg) {
+    Text *text = arg;
+    char saved = text->data[text->length];
+    text_bytes = (usize) text->length;
+
+    text->data[text->length] = '\0';
+    for (usize i = 0; i < iterations; i += 1)
+        content_check_content((uchar *) text->data, text->length);
+    text->data[text->length] = saved;
+    return;
+}
+
+/* Puts back the byte each call ends the text at. */
+void
+bench_remove_newline(usize iterations, void *arg) {
+    Text *text = arg;
+    char saved = text->data[text->length];
+    text_bytes = (usize) text->length;
+
+    text->data[text->length] = '\0';
+    for (usize i = 0; i < iterations; i += 1) {
+        int length = text->length;
+        char end;
+
+        content_remove_newline(text->data, &length);
+        end = length < text->length ? '\n' : '\0';
+        text->data[length] = end;
+    }
+    text->data[text->length] = saved;
+    return;
+}
+
+void
+bench_append_unique(usize iterations, void *arg) {
+    Text *texts = bench_texts(iterations, 0);
+    (void) arg;
+
+    bench_reset_timer();
+    for (usize i = 0; i < iterations; i += 1)
+        history_append(texts[i].data, texts[i].length, CLIPBOARD_TEXT);
+    bench_stop_timer();
+    free(texts);
+    return;
+}
+
+/* Entries still in history, so each append only moves one to the top. */
+void
+bench_append_repeated(usize iterations, void *arg) {
+    int32 size = *(int32 *) arg;
+    Text *texts;
+
+    texts = bench_texts(iterations, size);
+
+    bench_reset_timer();
+    for (usize i = 0; i < iterations; i += 1)
+        history_append(texts[i].data, texts[i].length, CLIPBOARD_TEXT);
+    bench_stop_timer();
+    free(texts);
+    return;
+}
+
+/* Half the lookups find an entry, half do not. */
+void
+bench_repeated_index(usize iterations, void *arg) {
+    int32 size = *(int32 *) arg;
+    Text *texts = bench_texts(iterations, size*2);
+    uint64 *hashes = util_malloc(iterations*sizeof (*hashes));
+    volatile int32 found = 0;
+
+    for (usize i = 0; i < iterations; i += 1)
+        hashes[i] = util_hash(texts[i].data, (usize) texts[i].length);
+
+    bench_reset_timer();
+    for (usize i = 0; i < iterations; i += 1) {
+        found += history_repeated_index(hashes[i], texts[i].data,
+                                        texts[i].length, CLIPBOARD_TEXT) >= 0;
+    }
+    bench_stop_timer();
+    free(hashes);
+    bench_free_texts(texts, iterations);
+    return;
+}
+
+/* A reader after every copy, so each view is made anew, and still
+ * holding it when the next copy comes, which then copies the pages it
+ * changes. */
+void
+bench_history_view(usize iterations, void *arg) {
+    int32 size = *(int32 *) arg;
+    Text *texts = bench_texts(iterations, size);
+    HistoryView *view = NULL;
+
+    bench_reset_timer();
+    for (usize i = 0; i < iterations; i += 1) {
+        history_append(texts[i].data, texts[i].length, CLIPBOARD_TEXT);
+        if (view)
+            history_view_release(view);
+        view = history_view();
+        history_view_entries(view);
+    }
+    bench_stop_timer();
+    if (view)
+        history_view_release(view);
+    free(texts);
+    return;
+}
+
+/* Two terms that most of the prose entries match somewhere. */
+void
+bench_search(usize iterations, void *arg) {
+    SearchMatch matches[SEARCH_TOP_K];
+    HistoryView *view = history_view();
+    volatile int32 found = 0;
+    (void) arg;
+
+    history_view_entries(view);
+    bench_reset_timer();
+    for (usize i = 0; i < iterations; i += 1)
+        found += search_top(view, "th an", matches, SEARCH_TOP_K);
+    bench_stop_timer();
+    history_view_release(view);
+    return;
+}
+
+/* Texts start with their number, so this finds about one candidate. */
+void
+bench_trigram_find(usize iterations, void *arg) {
+    int32 size = *(int32 *) arg;
+    int32 *ids = util_malloc((usize) size*sizeof (*ids));
+    volatile int32 found = 0;
+    char pattern[32];
+
+    snprintf(pattern, sizeof (pattern), "%d ", size / 2);
+    bench_reset_timer();
+    for (usize i = 0; i < iterations; i += 1)
+        found += trigram_find(pattern, strlen(pattern), ids);
+    bench_stop_timer();
+    free(ids);
+    return;
+}
+
+void
+bench_history_save(usize iterations, void *arg) {
+    char path[PATH_MAX + 32];
+    struct stat history_stat;
+
+    (void) arg;
+    for (usize i = 0; i < iterations; i += 1)
+        history_save();
+    bench_stop_timer();
+
+    snprintf(path, sizeof (path), "%s/clipsim/history", cache_home);
+    if (stat(path, &history_stat) == 0)
+        file_bytes = (usize) history_stat.st_size;
+    return;
+}
+
+void
+bench_history_read(usize iterations, void *arg) {
+    (void) arg;
+    for (usize i = 0; i < iterations; i += 1) {
+        history_close();
+        history_read();
+    }
+    return;
+}
@@ -0,0 +1,543 @@
+/* This file is part of clipsim.
+ * Copyright (C) 2023 Lucas Mior
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* End to end capture benchmark, run by scripts/bench_capture.sh against
+ * a clipsim daemon on a headless X server. It owns CLIPBOARD with new
+ * text or PNG data at a fixed rate, like an application would on every
+ * copy, and follows the daemon's journal with inotify. The latency of a
+ * copy is the time from XSetSelectionOwner until its APPEND record is in
+ * the journal, which is followed across compactions. Copies that never show up are counted as dropped: the
+ * daemon converts the selection once per burst of changes, so above
+ * some rate intermediate copies are expected to be lost.
+ *
+ * With -c, that percentage of the copies is instead done by the daemon,
+ * running `clipsim --copy -2` while this program owns CLIPBOARD, which
+ * is timed until the daemon takes the selection from it. Copies then
+ * come right after the daemon took ownership, which is when a daemon
+ * converting its own selection would stall for a second. */
+
+#include <X11/X.h>
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+
+#include <poll.h>
+#include <spawn.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+
+#include "clipsim.h"
+
+#define DRAIN_TIMEOUT_MS 2000
+
+typedef struct Copy {
+    uint64 hash;
+    uint64 published;
+    uint64 captured;
+} Copy;
+
+const char TEXT_TAG = (char) 0x01;
+const char IMAGE_TAG = (char) 0x02;
+mtx_t lock;
+char *program = "clipsim-bench-capture";
+
+static Display *display;
+static Window window;
+static Atom CLIPBOARD;
+static Atom TARGETS;
+static Atom UTF8_STRING;
+static Atom image_png;
+
+static Copy *copies;
+static int32 *copy_index;
+static usize index_mask;
+static char *data;
+static usize data_length;
+static bool data_image;
+static bool owner = false;
+static int32 captured = 0;
+static uint64 last_captured = 0;
+
+static char *clipsim;
+static uint64 recover_requested = 0;
+static uint64 *recover_latencies;
+static int32 recovered = 0;
+static int32 recover_failed = 0;
+
+static int journal_fd = -1;
+static char *journal_name;
+static int journal_watch = -1;
+static int directory_watch = -1;
+static usize journal_offset = 0;
+static char *journal_buffer = NULL;
+static usize journal_capacity = 0;
+
+static uint64 capture_now(void);
+static void capture_usage(void) __attribute__((noreturn));
+static void capture_publish(int32, usize, bool);
+static void capture_recover(void);
+static void capture_serve(XSelectionRequestEvent *);
+static void capture_watch(int);
+static void capture_read_journal(void);
+static void capture_report(int32, uint64, uint64);
+static void capture_percentiles(const char *, uint64 *, const int32);
+static int capture_compare(const void *, const void *);
+
+int main(int argc, char *argv[]) {
+    int32 count = 1000;
+    int32 rate = 100;
+    int32 text_size = 256;
+    int32 image_size = 64*1024;
+    int32 image_percent = 0;
+    int32 recover_percent = 0;
+    int32 published = 0;
+    uint64 start;
+    uint64 finished = 0;
+    uint64 last = 0;
+    char *directory;
+    int inotify;
+    int timer;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:s:S:i:c:")) != -1) {
+        int32 *target;
+        switch (opt) {
+        case 'n': target = &count;           break;
+        case 'r': target = &rate;            break;
+        case 's': target = &text_size;       break;
+        case 'S': target = &image_size;      break;
+        case 'i': target = &image_percent;   break;
+        case 'c': target = &recover_percent; break;
+        default:  capture_usage();
+        }
+        if ((util_string_int32(target, optarg) < 0) || (*target < 0))
+            capture_usage();
+    }
+    if ((count <= 0) || (rate <= 0)
+        || (image_percent > 100) || (recover_percent > 100)) {
+        capture_usage();
+    }
+    if ((clipsim = getenv("CLIPSIM")) == NULL)
+        clipsim = "./clipsim";
+    /* clipsim --copy is not waited for */
+    signal(SIGCHLD, SIG_IGN);
+    if ((text_size < 32) || (image_size < 64))
+        capture_usage();
+
+    if ((display = XOpenDisplay(NULL)) == NULL) {
+        error("Error opening X display.\n");
+        exit(EXIT_FAILURE);
+    }
+    {
+        usize max_request = (usize) XExtendedMaxRequestSize(display);
+        if (max_request == 0)
+            max_request = (usize) XMaxRequestSize(display);
+        if ((usize) MAX(text_size, image_size) > max_request*4 - 1024) {
+            error("Text and image sizes must be below %zu bytes,"
+                  " INCR transfers are not implemented here.\n",
+                  max_request*4 - 1024);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    CLIPBOARD   = XInternAtom(display, "CLIPBOARD",   False);
+    TARGETS     = XInternAtom(display, "TARGETS",     False);
+    UTF8_STRING = XInternAtom(display, "UTF8_STRING", False);
+    image_png   = XInternAtom(display, "image/png",   False);
+    window = XCreateSimpleWindow(display, DefaultRootWindow(display),
+                                 0, 0, 1, 1, 0, 0, 0);
+
+    {
+        char *XDG_CACHE_HOME;
+        usize length;
+        if ((XDG_CACHE_HOME = getenv("XDG_CACHE_HOME")) == NULL) {
+            error("XDG_CACHE_HOME needs to be set.\n");
+            exit(EXIT_FAILURE);
+        }
+        length = strlen(XDG_CACHE_HOME) + sizeof ("/clipsim/history.journal");
+        journal_name = util_malloc(length);
+        snprintf(journal_name, length, "%s/clipsim/history.journal",
+                                       XDG_CACHE_HOME);
+        directory = util_malloc(length);
+        snprintf(directory, length, "%s/clipsim", XDG_CACHE_HOME);
+    }
+    if ((journal_fd = open(journal_name, O_RDONLY)) < 0) {
+        error("Error opening %s: %s\nIs the daemon running?\n",
+              journal_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    journal_offset = (usize) lseek(journal_fd, 0, SEEK_END);
+
+    if ((inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        error("Error creating inotify instance: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    /* compaction renames a new journal over the old one */
+    if (((journal_watch = inotify_add_watch(inotify, journal_name,
+                                            IN_MODIFY)) < 0)
+        || ((directory_watch = inotify_add_watch(inotify, directory,
+                                                 IN_MOVED_TO | IN_CREATE)) < 0)) {
+        error("Error watching %s: %s\n", journal_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    free(directory);
+
+    if ((timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        error("Error creating timer: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    {
+        long interval = 1000000000L / rate;
+        struct itimerspec period = {
+            .it_interval = { interval / 1000000000L, interval % 1000000000L },
+            .it_value = { interval / 1000000000L, interval % 1000000000L },
+        };
+        timerfd_settime(timer, 0, &period, NULL);
+    }
+
+    copies = util_calloc((usize) count, sizeof (*copies));
+    index_mask = 1;
+    while (index_mask < (usize) count*2)
+        index_mask *= 2;
+    copy_index = util_malloc(index_mask*sizeof (*copy_index));
+    memset(copy_index, -1, index_mask*sizeof (*copy_index));
+    index_mask -= 1;
+    data = util_malloc((usize) MAX(text_size, image_size) + 1);
+    recover_latencies = util_malloc((usize) count*sizeof (*recover_latencies));
+
+    srand(0);
+    start = capture_now();
+    while (true) {
+        struct pollfd pollfds[3] = {
+            { .fd = ConnectionNumber(display), .events = POLLIN },
+            { .fd = inotify, .events = POLLIN },
+            { .fd = timer, .events = POLLIN },
+        };
+        int timeout = -1;
+
+        if (published == count) {
+            uint64 waited = (capture_now() - last) / 1000000;
+            if (waited >= DRAIN_TIMEOUT_MS)
+                break;
+            timeout = DRAIN_TIMEOUT_MS - (int) waited;
+        }
+
+        while (XPending(display)) {
+            XEvent xevent;
+            XNextEvent(display, &xevent);
+            if (xevent.type == SelectionRequest) {
+                capture_serve(&xevent.xselectionrequest);
+            } else if (xevent.type == SelectionClear) {
+                owner = false;
+                if (recover_requested) {
+                    recover_latencies[recovered] = capture_now()
+                                                   - recover_requested;
+                    recovered += 1;
+                    recover_requested = 0;
+                }
+            }
+        }
+        if (recover_requested && (capture_now() - recover_requested
+                                  >= DRAIN_TIMEOUT_MS*1000000ull)) {
+            recover_failed += 1;
+            recover_requested = 0;
+        }
+
+        if (poll(pollfds, LENGTH(pollfds), timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            error("Error polling: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        if (pollfds[1].revents & POLLIN) {
+            capture_watch(inotify);
+            if (published == count)
+                last = capture_now();
+        }
+        if ((pollfds[2].revents & POLLIN) && (published < count)) {
+            uint64 expirations;
+            if (read(timer, &expirations, sizeof (expirations)) > 0) {
+                bool image = (rand() % 100) < image_percent;
+                bool recover = recover_percent
+                               && ((rand() % 100) < recover_percent);
+
+                /* the daemon only takes the selection from us once */
+                if (recover && owner && (captured >= 2)
+                    && (recover_requested == 0)) {
+                    capture_recover();
+                    continue;
+                }
+                capture_publish(published, (usize) (image
+                                                     ? image_size
+                                                     : text_size), image);
+                published += 1;
+                if (published == count)
+                    finished = last = capture_now();
+            }
+        }
+    }
+
+    capture_report(count, finished - start,
+                   (last_captured ? last_captured : finished) - start);
+    XCloseDisplay(display);
+    exit(EXIT_SUCCESS);
+}
+
+uint64
+capture_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64) t.tv_sec*1000000000ull + (uint64) t.tv_nsec;
+}
+
+void
+capture_usage(void) {
+    fprintf(stderr, "usage: %s [-n copies] [-r copies per second]"
+                    " [-s text size] [-S image size] [-i image percent]"
+                    " [-c daemon copy percent]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+/* New clipboard content is never a repetition of a previous one, so that
+ * every copy ends up as its own entry. */
+void
+capture_publish(int32 id, usize length, bool image) {
+    Copy *copy = &copies[id];
+    usize i;
+    int n;
+
+    if (image) {
+        memcpy(data, "\x89PNG\r\n\x1a\n", 8);
+        n = snprintf(data + 8, length - 8, "%d", id);
+        i = 8 + (usize) n;
+    } else {
+        n = snprintf(data, length, "clipsim capture %d ", id);
+        i = (usize) n;
+    }
+    for (; i < length; i += 1)
+        data[i] = "abcdefghijklmnopqrstuvwxyz      "[rand() % 32];
+    if (!image)
+        data[length - 1] = '.';
+    data[length] = '\0';
+    data_length = length;
+    data_image = image;
+
+    copy->hash = util_hash(data, length);
+    for (usize j = copy->hash & index_mask; ; j = (j + 1) & index_mask) {
+        if (copy_index[j] < 0) {
+            copy_index[j] = id;
+            break;
+        }
+    }
+
+    copy->published = capture_now();
+    XSetSelectionOwner(display, CLIPBOARD, window, CurrentTime);
+    XFlush(display);
+    owner = true;
+    return;
+}
+
+/* Have the daemon copy the entry before the newest one and own it. */
+void
+capture_recover(void) {
+    char *argv[] = { clipsim, "--copy", "-2", NULL };
+    pid_t pid;
+    int status;
+
+    recover_requested = capture_now();
+    if ((status = posix_spawn(&pid, clipsim, NULL, NULL, argv, environ))) {
+        error("Error running %s: %s\n", clipsim, strerror(status));
+        exit(EXIT_FAILURE);
+    }
+    return;
+}
+
+void
+capture_serve(XSelectionRequestEvent *request) {
+    XSelectionEvent reply = {
+        .type = SelectionNotify,
+        .display = request->display,
+        .requestor = request->requestor,
+        .selection = request->selection,
+        .target = request->target,
+        .property = None,
+        .time = request->time,
+    };
+    Atom property = request->property ? request->property : request->target;
+    Atom target = data_image ? image_png : UTF8_STRING;
+
+    if (request->target == TARGETS) {
+        Atom targets[2] = { TARGETS, target };
+        XChangeProperty(display, request->requestor, property, XA_ATOM, 32,
+                        PropModeReplace, (uchar *) targets, LENGTH(targets));
+        reply.property = property;
+    } else if (request->target == target) {
+        XChangeProperty(display, request->requestor, property, target, 8,
+                        PropModeReplace, (uchar *) data, (int) data_length);
+        reply.property = property;
+    }
+
+    XSendEvent(display, request->requestor, False, 0, (XEvent *) &reply);
+    XFlush(display);
+    return;
+}
+
+/* Read the journal on every inotify event. When a new journal takes its
+ * name, what is left in the old one is read first, and the new one from
+ * the start: it begins with a base record and a copy of the records that
+ * came after the snapshot, some of which were already read, but a copy
+ * is only captured once. */
+void
+capture_watch(int inotify) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool renamed = false;
+    isize r;
+
+    while ((r = read(inotify, events, sizeof (events))) > 0) {
+        for (char *p = events; p < events + r;) {
+            struct inotify_event *event = (struct inotify_event *) p;
+            if ((event->wd == directory_watch) && event->len
+                && !strcmp(event->name, "history.journal")) {
+                renamed = true;
+            }
+            p += sizeof (*event) + event->len;
+        }
+    }
+
+    capture_read_journal();
+    if (!renamed)
+        return;
+
+    inotify_rm_watch(inotify, journal_watch);
+    close(journal_fd);
+    if ((journal_fd = open(journal_name, O_RDONLY)) < 0) {
+        error("Error opening %s: %s\n", journal_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if ((journal_watch = inotify_add_watch(inotify, journal_name,
+                                           IN_MODIFY)) < 0) {
+        error("Error watching %s: %s\n", journal_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    journal_offset = 0;
+    capture_read_journal();
+    return;
+}
+
+/* Parse the records appended since the last call. */
+void
+capture_read_journal(void) {
+    uint64 now = capture_now();
+    struct stat journal_stat;
+    usize used = 0;
+    isize r;
+
+    if (fstat(journal_fd, &journal_stat) < 0)
+        return;
+    if ((usize) journal_stat.st_size <= journal_offset)
+        return;
+
+    if ((usize) journal_stat.st_size - journal_offset > journal_capacity) {
+        journal_capacity = (usize) journal_stat.st_size - journal_offset;
+        journal_buffer = util_realloc(journal_buffer, journal_capacity);
+    }
+    while (used < (usize) journal_stat.st_size - journal_offset) {
+        r = pread(journal_fd, journal_buffer + used,
+                  (usize) journal_stat.st_size - journal_offset - used,
+                  (off_t) (journal_offset + used));
+        if (r <= 0)
+            break;
+        used += (usize) r;
+    }
+
+    {
+        usize offset = 0;
+        while (offset + sizeof (JournalRecord) <= used) {
+            JournalRecord record;
+            memcpy(&record, journal_buffer + offset, sizeof (record));
+            if (offset + sizeof (record) + record.length > used)
+                break;
+            offset += sizeof (record) + record.length;
+
+            if (record.type != JOURNAL_APPEND)
+                continue;
+            for (usize j = record.hash & index_mask;
+                 copy_index[j] >= 0; j = (j + 1) & index_mask) {
+                Copy *copy = &copies[copy_index[j]];
+                if ((copy->hash == record.hash) && (copy->captured == 0)) {
+                    copy->captured = now;
+                    last_captured = now;
+                    captured += 1;
+                    break;
+                }
+            }
+        }
+        journal_offset += offset;
+    }
+    return;
+}
+
+int
+capture_compare(const void *a, const void *b) {
+    uint64 x = *(const uint64 *) a;
+    uint64 y = *(const uint64 *) b;
+    return (x > y) - (x < y);
+}
+
+void
+capture_report(int32 count, uint64 publishing, uint64 capturing) {
+    uint64 *latencies = util_malloc((usize) count*sizeof (*latencies));
+    int32 n = 0;
+
+    for (int32 i = 0; i < count; i += 1) {
+        if (copies[i].captured) {
+            latencies[n] = copies[i].captured - copies[i].published;
+            n += 1;
+        }
+    }
+
+    printf("published\t%d\n", count);
+    printf("captured\t%d\n", n);
+    printf("dropped\t%d\n", count - n);
+    /* the timer ticks once per copy, on a slow X server that can be
+     * below the rate asked for */
+    printf("published_per_second\t%.1f\n",
+           (double) count / ((double) publishing / 1e9));
+    printf("captured_per_second\t%.1f\n",
+           (double) n / ((double) capturing / 1e9));
+    capture_percentiles("latency", latencies, n);
+    if (recovered || recover_failed) {
+        printf("recovered\t%d\n", recovered);
+        printf("recover_failed\t%d\n", recover_failed);
+        capture_percentiles("recover_latency", recover_latencies, recovered);
+    }
+    free(latencies);
+    return;
+}
+
+void
+capture_percentiles(const char *name, uint64 *latencies, const int32 n) {
+    if (n == 0)
+        return;
+    qsort(latencies, (usize) n, sizeof (*latencies), capture_compare);
+    printf("%s_p50_us\t%.1f\n", name,
+           (double) latencies[(n - 1)*50/100] / 1e3);
+    printf("%s_p99_us\t%.1f\n", name,
+           (double) latencies[(n - 1)*99/100] / 1e3);
+    printf("%s_max_us\t%.1f\n", name, (double) latencies[n - 1] / 1e3);
+    return;
+}
@@ -20,34 +20,84 @@
 #include <X11/Xlib.h>
 #include <X11/extensions/Xfixes.h>
 
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
 #include "clipsim.h"
-#define CHECK_TARGET_MAX_EVENTS 100
+#define CONVERT_TIMEOUT_MS 1000
+#define INCR_TIMEOUT_MS 2000
+#define MAX_TRANSFERS 16
+
+typedef struct Selection {
+    char *data;
+    usize length;
+    Atom target;
+    int references;
+    bool image;
+} Selection;
+
+typedef struct Transfer {
+    Selection *selection;
+    Window requestor;
+    Atom property;
+    Atom target;
+    usize offset;
+    uint64 deadline;
+} Transfer;
 
 static Display *display;
 static Atom CLIPBOARD, XSEL_DATA, INCR;
 static Atom UTF8_STRING, image_png, TARGETS;
 static Window window;
+static int xfixes_event_base;
+static int timer = -1;
+static int wake = -1;
+static usize chunk_size;
+static char *signal_program = NULL;
+static int signal_number = 0;
+
+/* owned is only touched by the X thread, pending is protected by lock */
+static Selection *owned = NULL;
+static Selection *pending = NULL;
+static Transfer transfers[MAX_TRANSFERS];
 
 static Atom clipboard_check_target(Atom);
 static int32 clipboard_get_clipboard(char **, ulong *);
+static int32 clipboard_get_property(char **, ulong *, int32);
+static int32 clipboard_get_incr(char **, ulong *, ulong, int32);
+static bool clipboard_wait_property(void);
+static bool clipboard_wait_event(XEvent *,
+                                 Bool (*)(Display *, XEvent *, XPointer), int);
+static Bool clipboard_is_new_property(Display *, XEvent *, XPointer);
+static Bool clipboard_is_selection_notify(Display *, XEvent *, XPointer);
+static void clipboard_take_ownership(void);
+static void clipboard_serve_request(XSelectionRequestEvent *);
+static bool clipboard_send_property(Transfer *, XSelectionRequestEvent *);
+static void clipboard_continue_transfer(XPropertyEvent *);
+static int clipboard_transfers_timeout(void);
+static void clipboard_expire_transfers(void);
+static void clipboard_end_transfer(Transfer *);
+static int clipboard_x_error(Display *, XErrorEvent *);
+static void clipboard_release(Selection *);
+static char *clipboard_read_file(const char *, usize *);
 
 int
 clipboard_daemon_watch(void) {
     DEBUG_PRINT("void");
     ulong color;
     Window root;
-    struct timespec pause;
-    pause.tv_sec = 0;
-    pause.tv_nsec = PAUSE10MS;
+    int xfixes_error_base;
+    struct pollfd pollfds[2];
     char *CLIPSIM_SIGNAL_NUMBER;
     char *CLIPSIM_SIGNAL_PROGRAM;
+    usize max_request;
 
     if ((display = XOpenDisplay(NULL)) == NULL) {
         error("Error opening X display.");
         exit(EXIT_FAILURE);
     }
 
-    int signal_number = 0;
     if ((CLIPSIM_SIGNAL_PROGRAM = getenv("CLIPSIM_SIGNAL_PROGRAM")) == NULL)
         error("CLIPSIM_SIGNAL_PROGRAM is not defined.\n");
     if ((CLIPSIM_SIGNAL_NUMBER = getenv("CLIPSIM_SIGNAL_NUMBER")) == NULL)
@@ -64,6 +114,8 @@ clipboard_daemon_watch(void) {
         }
         signal_number += SIGRTMIN;
     }
+    signal_program = CLIPSIM_SIGNAL_PROGRAM;
+    XSetErrorHandler(clipboard_x_error);
 
     CLIPBOARD   = XInternAtom(display, "CLIPBOARD",   False);
     XSEL_DATA   = XInternAtom(display, "XSEL_DATA",   False);
@@ -72,47 +124,124 @@ clipboard_daemon_watch(void) {
     image_png   = XInternAtom(display, "image/png",   False);
     TARGETS     = XInternAtom(display, "TARGETS",     False);
 
+    if (!XFixesQueryExtension(display, &xfixes_event_base, &xfixes_error_base)) {
+        error("XFixes extension is not available.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        error("Error creating timer: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    /* starts signaled in case a copy arrived before the display was open */
+    if ((wake = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        error("Error creating eventfd: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if ((max_request = (usize) XExtendedMaxRequestSize(display)) == 0)
+        max_request = (usize) XMaxRequestSize(display);
+    chunk_size = MIN(max_request*4 - 1024, 256*1024);
+
     root = DefaultRootWindow(display);
     color = BlackPixel(display, DefaultScreen(display));
     window = XCreateSimpleWindow(display, root, 0,0, 1,1, 0, color, color);
+    XSelectInput(display, window, PropertyChangeMask);
 
     XFixesSelectSelectionInput(display, root, CLIPBOARD, (ulong)
                                XFixesSetSelectionOwnerNotifyMask
                              | XFixesSelectionClientCloseNotifyMask
                              | XFixesSelectionWindowDestroyNotifyMask);
 
+    pollfds[0].fd = ConnectionNumber(display);
+    pollfds[0].events = POLLIN;
+    pollfds[1].fd = wake;
+    pollfds[1].events = POLLIN;
+
     while (true) {
-        XEvent xevent;
         char *save = NULL;
         ulong length;
+        bool changed = false;
+        uint64 start;
+        int32 kind;
+        int timeout = XPending(display) > 0 ? 0 : clipboard_transfers_timeout();
+
+        if ((poll(pollfds, LENGTH(pollfds), timeout) < 0) && (errno != EINTR))
+            error("Error polling X connection: %s\n", strerror(errno));
+        if (pollfds[1].revents & POLLIN)
+            clipboard_take_ownership();
+        clipboard_expire_transfers();
+
+        /* a burst of owner changes needs a single conversion */
+        while (XPending(display) > 0) {
+            XEvent xevent;
+            XFixesSelectionNotifyEvent *notify;
+            (void) XNextEvent(display, &xevent);
+
+            switch (xevent.type) {
+            case SelectionRequest:
+                clipboard_serve_request(&xevent.xselectionrequest);
+                break;
+            case SelectionClear:
+                if (xevent.xselectionclear.selection == CLIPBOARD) {
+                    clipboard_release(owned);
+                    owned = NULL;
+                }
+                break;
+            case PropertyNotify:
+                clipboard_continue_transfer(&xevent.xproperty);
+                break;
+            default:
+                if (xevent.type != xfixes_event_base + XFixesSelectionNotify)
+                    break;
+                /* our own content is already in history */
+                notify = (XFixesSelectionNotifyEvent *) &xevent;
+                if ((notify->subtype == XFixesSetSelectionOwnerNotify)
+                    && (notify->owner == window)) {
+                    break;
+                }
+                stats_count(STATS_EVENTS, 1);
+                changed = true;
+            }
+        }
+        if (!changed)
+            continue;
+        /* events of a previous owner can come after we took ownership,
+         * and converting our own selection would wait for this thread */
+        if (XGetSelectionOwner(display, CLIPBOARD) == window)
+            continue;
 
-        nanosleep(&pause, NULL);
-        (void) XNextEvent(display, &xevent);
-        mtx_lock(&lock);
+        if (signal_program)
+            send_signal(signal_program, signal_number);
 
-        if (CLIPSIM_SIGNAL_PROGRAM)
-            send_signal(CLIPSIM_SIGNAL_PROGRAM, signal_number);
+        /* the owner can take seconds to answer, readers must not wait
+         * for it, so the lock is only taken by history_append */
+        start = stats_now();
+        kind = clipboard_get_clipboard(&save, &length);
+        stats_record(STATS_CONVERT, start);
+        stats_count(STATS_CONVERSIONS, 1);
 
-        switch (clipboard_get_clipboard(&save, &length)) {
+        switch (kind) {
         case CLIPBOARD_TEXT:
-            history_append(save, (int) length);
-            break;
         case CLIPBOARD_IMAGE:
-            history_append(save, (int) length);
+            history_append(save, (int) length, kind);
             break;
         case CLIPBOARD_OTHER:
             error("Unsupported format."
                   " Clipsim only works with UTF-8 and images.\n");
+            stats_count(STATS_REJECTED, 1);
             break;
         case CLIPBOARD_LARGE:
-            error("Buffer is too large and INCR reading is not implemented yet."
-                  " This data won't be saved to history.\n");
+            error("Buffer is larger than %d bytes."
+                  " This data won't be saved to history.\n", ENTRY_MAX_LENGTH);
+            stats_count(STATS_REJECTED, 1);
             break;
         case CLIPBOARD_ERROR:
+            stats_lock();
             history_recover(-1);
+            stats_unlock();
             break;
         }
-        mtx_unlock(&lock);
     }
 }
 
@@ -125,17 +254,14 @@ clipboard_check_target(const Atom target) {
         DEBUG_PRINT("%lu", target);
 #endif
     XEvent xevent;
-    int nevents = 0;
 
     XConvertSelection(display, CLIPBOARD, target, XSEL_DATA,
                       window, CurrentTime);
-    do {
-        if (nevents >= CHECK_TARGET_MAX_EVENTS)
-            return 0;
-        (void) XNextEvent(display, &xevent);
-        nevents += 1;
-    } while (xevent.type != SelectionNotify
-          || xevent.xselection.selection != CLIPBOARD);
+    if (!clipboard_wait_event(&xevent, clipboard_is_selection_notify,
+                              CONVERT_TIMEOUT_MS)) {
+        error("Timeout waiting for clipboard owner to convert selection.\n");
+        return 0;
+    }
 
     return xevent.xselection.property;
 }
@@ -143,35 +269,485 @@ clipboard_check_target(const Atom target) {
 int32
 clipboard_get_clipboard(char **save, ulong *length) {
     DEBUG_PRINT("%p, %p", (void *) save, (void *) length);
+
+    if (clipboard_check_target(UTF8_STRING))
+        return clipboard_get_property(save, length, CLIPBOARD_TEXT);
+    if (clipboard_check_target(image_png))
+        return clipboard_get_property(save, length, CLIPBOARD_IMAGE);
+    if (clipboard_check_target(TARGETS))
+        return CLIPBOARD_OTHER;
+
+    return CLIPBOARD_ERROR;
+}
+
+int32
+clipboard_get_property(char **save, ulong *length, const int32 kind) {
+    DEBUG_PRINT("%p, %p, %d", (void *) save, (void *) length, kind);
     int actual_format_return;
     ulong nitems_return;
     ulong bytes_after_return;
     Atom actual_type_return;
+    uchar *data = NULL;
+
+    XGetWindowProperty(display, window, XSEL_DATA, 0, LONG_MAX/4,
+                       False, AnyPropertyType, &actual_type_return,
+                       &actual_format_return, &nitems_return,
+                       &bytes_after_return, &data);
+    if (actual_type_return == INCR) {
+        ulong hint = 0;
+        if (data && (nitems_return > 0) && (actual_format_return == 32))
+            hint = (ulong) *((long *) data);
+        XFree(data);
+        return clipboard_get_incr(save, length, hint, kind);
+    }
+
+    *save = (char *) data;
+    *length = nitems_return;
+    return kind;
+}
+
+/* INCR transfer (ICCCM 2.7.2): deleting the property tells the owner to
+ * start sending; every chunk arrives as a new value of XSEL_DATA and must
+ * be deleted after reading. A zero length chunk ends the transfer. */
+int32
+clipboard_get_incr(char **save, ulong *length,
+                   const ulong hint, const int32 kind) {
+    DEBUG_PRINT("%p, %p, %lu, %d", (void *) save, (void *) length, hint, kind);
+    XEvent stale;
+    char *buffer;
+    usize capacity;
+    usize used = 0;
+    bool too_large = false;
+
+    capacity = MIN(MAX(hint, BUFSIZ), ENTRY_MAX_LENGTH) + 1;
+    buffer = util_malloc(capacity);
+
+    /* discard the notification for the INCR property itself */
+    while (XCheckIfEvent(display, &stale, clipboard_is_new_property, NULL));
+
+    XDeleteProperty(display, window, XSEL_DATA);
+    while (true) {
+        int actual_format_return;
+        ulong nitems_return;
+        ulong bytes_after_return;
+        Atom actual_type_return;
+        uchar *chunk = NULL;
+        usize chunk_length;
+
+        if (!clipboard_wait_property()) {
+            error("Timeout waiting for INCR chunk from clipboard owner.\n");
+            free(buffer);
+            return CLIPBOARD_ERROR;
+        }
 
-    if (clipboard_check_target(UTF8_STRING)) {
         XGetWindowProperty(display, window, XSEL_DATA, 0, LONG_MAX/4,
-                           False, AnyPropertyType, &actual_type_return,
+                           True, AnyPropertyType, &actual_type_return,
                            &actual_format_return, &nitems_return,
-                           &bytes_after_return, (uchar **) save);
-        if (actual_type_return == INCR)
-            return CLIPBOARD_LARGE;
+                           &bytes_after_return, &chunk);
+        chunk_length = nitems_return;
+        if (actual_format_return == 16)
+            chunk_length *= 2;
+        else if (actual_format_return == 32)
+            chunk_length *= sizeof (long);
 
-        *length = nitems_return;
-        return CLIPBOARD_TEXT;
+        if (chunk_length == 0) {
+            XFree(chunk);
+            break;
+        }
+
+        if (!too_large && (used + chunk_length > ENTRY_MAX_LENGTH)) {
+            too_large = true;
+            free(buffer);
+            buffer = NULL;
+        }
+        if (!too_large) {
+            if (used + chunk_length + 1 > capacity) {
+                capacity = MIN(MAX(capacity*2, used + chunk_length + 1),
+                               ENTRY_MAX_LENGTH + 1);
+                buffer = util_realloc(buffer, capacity);
+            }
+            memcpy(buffer + used, chunk, chunk_length);
+            used += chunk_length;
+        }
+        XFree(chunk);
     }
-    if (clipboard_check_target(image_png)) {
-        XGetWindowProperty(display, window, XSEL_DATA, 0, LONG_MAX/4,
-                           False, AnyPropertyType, &actual_type_return,
-                           &actual_format_return, &nitems_return,
-                           &bytes_after_return, (uchar **) save);
-        if (actual_type_return == INCR)
-            return CLIPBOARD_LARGE;
 
-        *length = nitems_return;
-        return CLIPBOARD_IMAGE;
+    if (too_large)
+        return CLIPBOARD_LARGE;
+
+    buffer[used] = '\0';
+    *save = buffer;
+    *length = used;
+    return (*length > 0) ? kind : CLIPBOARD_ERROR;
+}
+
+bool
+clipboard_wait_property(void) {
+    DEBUG_PRINT("void");
+    XEvent xevent;
+    return clipboard_wait_event(&xevent, clipboard_is_new_property,
+                                INCR_TIMEOUT_MS);
+}
+
+/* Wait for an event matching predicate, leaving every other event queued
+ * for the main loop. The deadline is kept by a timerfd polled together
+ * with the X connection. */
+bool
+clipboard_wait_event(XEvent *xevent,
+                     Bool (*predicate)(Display *, XEvent *, XPointer),
+                     const int timeout_ms) {
+    DEBUG_PRINT("%p, %p, %d", (void *) xevent, (void *) predicate, timeout_ms);
+    struct itimerspec deadline = {0};
+    struct pollfd pollfds[2];
+    bool found = false;
+
+    pollfds[0].fd = ConnectionNumber(display);
+    pollfds[0].events = POLLIN;
+    pollfds[1].fd = timer;
+    pollfds[1].events = POLLIN;
+
+    deadline.it_value.tv_sec = timeout_ms / 1000;
+    deadline.it_value.tv_nsec = (timeout_ms % 1000)*1000*1000;
+    if (timerfd_settime(timer, 0, &deadline, NULL) < 0) {
+        error("Error arming timer: %s\n", strerror(errno));
+        return false;
     }
-    if (clipboard_check_target(TARGETS))
-        return CLIPBOARD_OTHER;
 
-    return CLIPBOARD_ERROR;
+    XFlush(display);
+    while (!(found = XCheckIfEvent(display, xevent, predicate, NULL))) {
+        if (poll(pollfds, LENGTH(pollfds), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            error("Error polling X connection: %s\n", strerror(errno));
+            break;
+        }
+        if (pollfds[1].revents & POLLIN)
+            break;
+    }
+
+    deadline.it_value.tv_sec = 0;
+    deadline.it_value.tv_nsec = 0;
+    if (timerfd_settime(timer, 0, &deadline, NULL) < 0)
+        error("Error disarming timer: %s\n", strerror(errno));
+    return found;
+}
+
+Bool
+clipboard_is_new_property(Display *unused, XEvent *xevent, XPointer arg) {
+    (void) unused;
+    (void) arg;
+    return (xevent->type == PropertyNotify)
+           && (xevent->xproperty.window == window)
+           && (xevent->xproperty.atom == XSEL_DATA)
+           && (xevent->xproperty.state == PropertyNewValue);
+}
+
+Bool
+clipboard_is_selection_notify(Display *unused, XEvent *xevent, XPointer arg) {
+    (void) unused;
+    (void) arg;
+    return (xevent->type == SelectionNotify)
+           && (xevent->xselection.selection == CLIPBOARD);
+}
+
+/* Called with lock held, from either thread. The X thread picks the
+ * selection up when wake is signaled. */
+void
+clipboard_own(const char *data, const usize length, const bool image) {
+    DEBUG_PRINT("%p, %zu, %d", (void *) data, length, image);
+    uint64 one = 1;
+
+    if (pending == NULL)
+        pending = util_calloc(1, sizeof (*pending));
+    free(pending->data);
+    pending->data = util_memdup(data, length + 1);
+    pending->length = length;
+    pending->image = image;
+
+    if ((wake >= 0) && (write(wake, &one, sizeof (one)) < 0))
+        error("Error waking clipboard thread: %s\n", strerror(errno));
+    return;
+}
+
+void
+clipboard_take_ownership(void) {
+    DEBUG_PRINT("void");
+    Selection *selection;
+    uint64 count;
+
+    (void) read(wake, &count, sizeof (count));
+
+    stats_lock();
+    selection = pending;
+    pending = NULL;
+    stats_unlock();
+
+    if (selection == NULL)
+        return;
+
+    if (selection->image) {
+        char *path = selection->data;
+        selection->target = image_png;
+        if ((selection->data = clipboard_read_file(path,
+                                                   &selection->length)) == NULL) {
+            free(path);
+            free(selection);
+            return;
+        }
+        free(path);
+    } else {
+        selection->target = UTF8_STRING;
+    }
+    selection->references = 1;
+
+    XSetSelectionOwner(display, CLIPBOARD, window, CurrentTime);
+    if (XGetSelectionOwner(display, CLIPBOARD) != window) {
+        error("Error taking ownership of the clipboard.\n");
+        clipboard_release(selection);
+        return;
+    }
+
+    clipboard_release(owned);
+    owned = selection;
+    if (signal_program)
+        send_signal(signal_program, signal_number);
+    return;
+}
+
+void
+clipboard_serve_request(XSelectionRequestEvent *request) {
+    DEBUG_PRINT("%p", (void *) request);
+    XSelectionEvent reply = {
+        .type = SelectionNotify,
+        .display = request->display,
+        .requestor = request->requestor,
+        .selection = request->selection,
+        .target = request->target,
+        .property = None,
+        .time = request->time,
+    };
+    Atom property = request->property;
+
+    /* obsolete clients leave the property for us to choose */
+    if (property == None)
+        property = request->target;
+
+    if ((request->selection == CLIPBOARD) && owned) {
+        if (request->target == TARGETS) {
+            Atom targets[] = { TARGETS, owned->target };
+            XChangeProperty(display, request->requestor, property, XA_ATOM,
+                            32, PropModeReplace,
+                            (uchar *) targets, LENGTH(targets));
+            reply.property = property;
+        } else if (request->target == owned->target) {
+            Transfer transfer = {
+                .selection = owned,
+                .requestor = request->requestor,
+                .property = property,
+                .target = owned->target,
+                .offset = 0,
+            };
+            if (clipboard_send_property(&transfer, request))
+                reply.property = property;
+        }
+    }
+
+    XSendEvent(display, request->requestor, False, NoEventMask,
+               (XEvent *) &reply);
+    XFlush(display);
+    return;
+}
+
+bool
+clipboard_send_property(Transfer *transfer, XSelectionRequestEvent *request) {
+    DEBUG_PRINT("%p, %p", (void *) transfer, (void *) request);
+    Selection *selection = transfer->selection;
+    Transfer *slot = NULL;
+    long length;
+
+    if (selection->length < chunk_size) {
+        XChangeProperty(display, request->requestor, transfer->property,
+                        transfer->target, 8, PropModeReplace,
+                        (uchar *) selection->data, (int) selection->length);
+        return true;
+    }
+
+    for (int i = 0; i < MAX_TRANSFERS; i += 1) {
+        if (transfers[i].selection == NULL) {
+            slot = &transfers[i];
+            break;
+        }
+    }
+    if (slot == NULL) {
+        error("Too many simultaneous INCR transfers.\n");
+        return false;
+    }
+
+    *slot = *transfer;
+    slot->deadline = stats_now() + INCR_TIMEOUT_MS*1000000ull;
+    selection->references += 1;
+    length = (long) selection->length;
+
+    XSelectInput(display, request->requestor, PropertyChangeMask);
+    XChangeProperty(display, request->requestor, transfer->property,
+                    INCR, 32, PropModeReplace, (uchar *) &length, 1);
+    return true;
+}
+
+/* The requestor deletes the property to ask for the next chunk. */
+void
+clipboard_continue_transfer(XPropertyEvent *event) {
+    DEBUG_PRINT("%p", (void *) event);
+    Transfer *transfer = NULL;
+    usize left;
+    usize send;
+
+    if (event->state != PropertyDelete)
+        return;
+    for (int i = 0; i < MAX_TRANSFERS; i += 1) {
+        if ((transfers[i].selection != NULL)
+            && (transfers[i].requestor == event->window)
+            && (transfers[i].property == event->atom)) {
+            transfer = &transfers[i];
+            break;
+        }
+    }
+    if (transfer == NULL)
+        return;
+
+    left = transfer->selection->length - transfer->offset;
+    send = MIN(left, chunk_size);
+    XChangeProperty(display, transfer->requestor, transfer->property,
+                    transfer->target, 8, PropModeReplace,
+                    (uchar *) transfer->selection->data + transfer->offset,
+                    (int) send);
+    transfer->offset += send;
+    transfer->deadline = stats_now() + INCR_TIMEOUT_MS*1000000ull;
+
+    if (send == 0)
+        clipboard_end_transfer(transfer);
+    XFlush(display);
+    return;
+}
+
+/* Milliseconds until the first transfer deadline, -1 if there is none,
+ * as poll() takes it. */
+int
+clipboard_transfers_timeout(void) {
+    uint64 first = UINT64_MAX;
+    uint64 now;
+
+    for (int i = 0; i < MAX_TRANSFERS; i += 1) {
+        if (transfers[i].selection != NULL)
+            first = MIN(first, transfers[i].deadline);
+    }
+    if (first == UINT64_MAX)
+        return -1;
+    if ((now = stats_now()) >= first)
+        return 0;
+    return (int) ((first - now + 999999) / 1000000);
+}
+
+/* A requestor that died or stopped deleting the property would keep its
+ * slot forever, so transfers idle for INCR_TIMEOUT_MS are dropped. */
+void
+clipboard_expire_transfers(void) {
+    uint64 now = stats_now();
+    bool expired = false;
+
+    for (int i = 0; i < MAX_TRANSFERS; i += 1) {
+        if ((transfers[i].selection != NULL) && (transfers[i].deadline <= now)) {
+            error("INCR transfer to window %lu timed out.\n",
+                  transfers[i].requestor);
+            clipboard_end_transfer(&transfers[i]);
+            expired = true;
+        }
+    }
+    if (expired)
+        XFlush(display);
+    return;
+}
+
+/* Other transfers to the same window still need its property events. */
+void
+clipboard_end_transfer(Transfer *transfer) {
+    DEBUG_PRINT("%p", (void *) transfer);
+    Window requestor = transfer->requestor;
+    bool shared = false;
+
+    clipboard_release(transfer->selection);
+    memset(transfer, 0, sizeof (*transfer));
+
+    for (int i = 0; i < MAX_TRANSFERS; i += 1) {
+        if ((transfers[i].selection != NULL)
+            && (transfers[i].requestor == requestor)) {
+            shared = true;
+            break;
+        }
+    }
+    if (!shared)
+        XSelectInput(display, requestor, NoEventMask);
+    return;
+}
+
+/* Requestors can go away in the middle of a transfer, which must not
+ * take the daemon down with them like the default handler would. */
+int
+clipboard_x_error(Display *unused, XErrorEvent *event) {
+    char text[256];
+    (void) unused;
+
+    XGetErrorText(display, event->error_code, text, sizeof (text));
+    error("X error on resource %lu: %s\n", event->resourceid, text);
+    return 0;
+}
+
+void
+clipboard_release(Selection *selection) {
+    DEBUG_PRINT("%p", (void *) selection);
+    if (selection == NULL)
+        return;
+    selection->references -= 1;
+    if (selection->references <= 0) {
+        free(selection->data);
+        free(selection);
+    }
+    return;
+}
+
+char *
+clipboard_read_file(const char *path, usize *length) {
+    DEBUG_PRINT("%s, %p", path, (void *) length);
+    struct stat file_stat;
+    char *data;
+    usize copied = 0;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        error("Error opening %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &file_stat) < 0) {
+        error("Error getting information on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    *length = (usize) file_stat.st_size;
+    data = util_malloc(*length + 1);
+    while (copied < *length) {
+        isize r = read(fd, data + copied, *length - copied);
+        if (r <= 0) {
+            error("Error reading %s: %s\n", path,
+                  r < 0 ? strerror(errno) : "unexpected end of file");
+            free(data);
+            close(fd);
+            return NULL;
+        }
+        copied += (usize) r;
+    }
+    data[*length] = '\0';
+
+    close(fd);
+    return data;
 }
@@ -30,10 +30,12 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <threads.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #ifndef CLIPSIM_H
 #define CLIPSIM_H
@@ -59,12 +61,16 @@ do { \
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define IS_SPACE(x) ((x == ' ') || (x == '\t') || (x == '\n'))
 
-#define PAUSE10MS (1000 * 1000 * 10)
 #define HISTORY_BUFFER_SIZE 128
-#define HISTORY_KEEP_SIZE (HISTORY_BUFFER_SIZE/2)
-#define ENTRY_MAX_LENGTH BUFSIZ
+#define HISTORY_MAX_SIZE (1 << 24)
+#define ENTRY_MAX_LENGTH (64*1024*1024)
 #define PRINT_DIGITS 3
 #define TRIMMED_SIZE 255
+#define UTIL_SLAB_MAX 4096
+#define UTIL_SPLICE_SIZE (1 << 16)
+#define SEARCH_TOP_K 20
+#define SEARCH_QUERY_MAX 256
+#define SEARCH_MAX_THREADS 8
 
 #ifndef INTEGERS
 #define INTEGERS
@@ -88,18 +94,88 @@ typedef ssize_t isize;
 #endif
 
 typedef struct Entry {
+    uint64 hash;
     int content_length;
     int trimmed_length;
     char *content;
     char *trimmed;
     char *image_path;
+    int32 older;
+    int32 newer;
+    int32 sequence;
+    int32 document;
 } Entry;
 
+/* The history as it was when taken, see history_view(). entries and
+ * listing, the --print output ready for writev(), are only there after
+ * history_view_entries(). */
+typedef struct HistoryView {
+    Entry *entries;
+    struct iovec *listing;
+    struct ViewPage **pages;
+    struct HistoryView *newer;
+    uint64 generation;
+    mtx_t build;
+    int32 npages;
+    int32 count;
+    int32 references;
+    bool built;
+} HistoryView;
+
+enum {
+    JOURNAL_BASE = 0,
+    JOURNAL_APPEND,
+    JOURNAL_REORDER,
+    JOURNAL_REMOVE,
+};
+
+/* Every record is followed by length bytes of payload. The checksum
+ * covers the rest of the header and the payload, so a record torn by a
+ * crash is detected and the journal is cut there. The journal is
+ * $XDG_CACHE_HOME/clipsim/history.journal, see history.c. */
+typedef struct JournalRecord {
+    uint8 type;
+    uint8 kind;
+    uint16 unused;
+    uint32 length;
+    uint64 hash;
+    uint64 checksum;
+} JournalRecord;
+
+enum {
+    STATS_CONVERT = 0,
+    STATS_CLASSIFY,
+    STATS_DEDUP,
+    STATS_TRIM,
+    STATS_JOURNAL,
+    STATS_SYNC,
+    STATS_SAVE,
+    STATS_LOCK_WAIT,
+    STATS_LOCK_HOLD,
+    STATS_STAGES,
+};
+
+enum {
+    STATS_EVENTS = 0,
+    STATS_CONVERSIONS,
+    STATS_ENTRIES,
+    STATS_DUPLICATES,
+    STATS_REJECTED,
+    STATS_BYTES,
+    STATS_REQUESTS,
+    STATS_COUNTERS,
+};
+
+typedef struct SearchMatch {
+    int32 id;
+    int32 score;
+} SearchMatch;
+
 typedef struct File {
     FILE *file;
     char *name;
     int fd;
-    int unused;
+    bool anonymous;
 } File;
 
 enum {
@@ -110,17 +186,26 @@ enum {
     CLIPBOARD_ERROR,
 };
 
+enum {
+    CONTENT_KERNELS_SCALAR = 0,
+    CONTENT_KERNELS_SSE2,
+    CONTENT_KERNELS_AVX2,
+    CONTENT_KERNELS_LAST,
+};
+
 enum {
     COMMAND_PRINT = 0,
     COMMAND_INFO,
     COMMAND_COPY,
     COMMAND_REMOVE,
     COMMAND_SAVE,
+    COMMAND_STATS,
+    COMMAND_SEARCH,
+    COMMAND_GREP,
     COMMAND_DAEMON,
     COMMAND_HELP,
 };
 
-extern Entry entries[];
 extern mtx_t lock;
 extern const char TEXT_TAG;
 extern const char IMAGE_TAG;
@@ -129,31 +214,76 @@ extern char *program;
 void content_remove_newline(char *, int *);
 void content_trim_spaces(char **, int *, char *, int);
 int32 content_check_content(uchar *, int);
+bool content_use_kernels(const int32);
 
 int32 history_lastindex(void);
+usize history_content_bytes(void);
+Entry *history_entry(const int32);
+int32 history_entry_id(const Entry *);
+Entry *history_newest(void);
+Entry *history_older(const Entry *);
+HistoryView *history_view(void);
+void history_view_entries(HistoryView *);
+void history_view_release(HistoryView *);
 void history_read(void);
-void history_append(char *, int);
+void history_close(void);
+int32 history_repeated_index(const uint64, const char *, int, const int32);
+void history_append(char *, int, const int32);
 bool history_save(void);
+uint64 history_save_ask(const int);
+int history_saved(const uint64);
+void history_writer_start(void);
 void history_recover(int32);
+void history_recover_list(const int32 *, const int32);
 void history_remove(int32);
+void history_remove_list(const int32 *, const int32);
 
 int clipboard_daemon_watch(void) __attribute__((noreturn));
+void clipboard_own(const char *, const usize, const bool);
 
-int ipc_daemon_listen_fifo(void *) __attribute__((noreturn));
-void ipc_client_speak_fifo(uint, int32);
+int ipc_daemon_listen(void *) __attribute__((noreturn));
+void ipc_client_speak(uint, int32, const char *);
 
 void send_signal(const char *, const int);
 
+int32 search_top(const HistoryView *, const char *, SearchMatch *, const int32);
+
+void trigram_add(Entry *);
+void trigram_remove(Entry *);
+void trigram_close(void);
+int32 trigram_find(const char *, const usize, int32 *);
+
+void stats_start(void);
+uint64 stats_now(void);
+void stats_record(const int, const uint64);
+void stats_count(const int, const uint64);
+void stats_lock(void);
+void stats_unlock(void);
+void stats_wait(cnd_t *, const struct timespec *);
+void stats_print(FILE *, const bool);
+
 void *util_malloc(const usize);
 void *util_memdup(const void *, const usize);
 char *util_strdup(const char *);
 void *util_realloc(void *, const usize);
 void *util_calloc(const usize, const usize);
+void *util_slab_alloc(const usize);
+void util_slab_free(void *, const usize);
+void *util_slab_move(void *, const usize);
+usize util_slab_mapped(void);
 int util_string_int32(int32 *, const char *);
+uint64 util_hash(const void *, const usize);
 void util_segv_handler(int) __attribute__((noreturn));
 void util_close(File *);
 int util_open(File *, const int);
-int util_copy_file(const char *, const char *);
+isize util_copy_range(const int, const int, usize);
+bool util_splice(const int, const int, usize);
+bool util_write_all(const int, const void *, usize);
+bool util_writev_all(const int, struct iovec *, int);
+int util_create_open(File *);
+bool util_create_commit(File *);
+bool util_create_link(File *);
+void util_create_abort(File *);
 void util_die_notify(const char *, ...) __attribute__((noreturn));
 void error(char *, ...);
 
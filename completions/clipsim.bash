@@ -17,6 +17,9 @@ _clipsim_completion() {
     "-c --copy"
     "-r --remove"
     "-s --save"
+    "-t --stats"
+    "-f --search"
+    "-g --grep"
     "-d --daemon"
     "-h --help"
   )
@@ -26,6 +29,13 @@ _clipsim_completion() {
       _clipsim_entries
       return
       ;;
+    -f|--search|-g|--grep)
+      return
+      ;;
+    -t|--stats)
+      COMPREPLY=($(compgen -W "prometheus" -- "${cur}"))
+      return
+      ;;
   esac
 
   COMPREPLY=($(compgen -W "${commands[*]}" -- "${cur}"))
@@ -10,6 +10,12 @@ complete -c clipsim -l remove -d 'remove entry number <n>' -a '(_clipsim_entries
 complete -c clipsim -s r -d 'remove entry number <n>' -a '(_clipsim_entries)'
 complete -c clipsim -l save -d 'save history to $XDG_CACHE_HOME/clipsim/history'
 complete -c clipsim -s s -d 'save history to $XDG_CACHE_HOME/clipsim/history'
+complete -c clipsim -l stats -d 'print daemon statistics, [prometheus] for textfiles' -a 'prometheus'
+complete -c clipsim -s t -d 'print daemon statistics, [prometheus] for textfiles' -a 'prometheus'
+complete -c clipsim -l search -d 'print the [k] entries best matching <query>' -x
+complete -c clipsim -s f -d 'print the [k] entries best matching <query>' -x
+complete -c clipsim -l grep -d 'print the entries containing <text>' -x
+complete -c clipsim -s g -d 'print the entries containing <text>' -x
 complete -c clipsim -l daemon -d 'spawn daemon (clipboard watcher and command listener)'
 complete -c clipsim -s d -d 'spawn daemon (clipboard watcher and command listener)'
 complete -c clipsim -l help -d 'print this help message'
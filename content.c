@@ -18,56 +18,82 @@
 #include <magic.h>
 #include "clipsim.h"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CONTENT_X86
+#endif
+
+/* Loaded on first use and kept for the lifetime of the daemon: parsing
+ * the compiled database takes milliseconds. */
+static magic_t magic = NULL;
+static bool magic_failed = false;
+
+/* Whitespace scanning kernels, picked once for the running CPU. All of
+ * them give exactly the same results as the scalar ones, which
+ * clipsim-bench checks through content_use_kernels. */
+static usize (*content_skip_spaces)(const uchar *, const usize) = NULL;
+static usize (*content_strip_newlines)(const uchar *, usize) = NULL;
+static usize (*content_collapse_spaces)(char *, const char *,
+                                        usize, const usize) = NULL;
+
+static void content_select_kernels(void);
+static usize content_skip_spaces_scalar(const uchar *, const usize);
+static usize content_strip_newlines_scalar(const uchar *, usize);
+static usize content_collapse_spaces_scalar(char *, const char *,
+                                            usize, const usize);
+#ifdef CONTENT_X86
+static usize content_skip_spaces_sse2(const uchar *, const usize);
+static usize content_strip_newlines_sse2(const uchar *, usize);
+static usize content_collapse_spaces_sse2(char *, const char *,
+                                          usize, const usize);
+static usize content_skip_spaces_avx2(const uchar *, const usize);
+static usize content_strip_newlines_avx2(const uchar *, usize);
+static usize content_collapse_spaces_avx2(char *, const char *,
+                                          usize, const usize);
+#endif
+static bool content_is_image(const uchar *, const int);
+static bool content_is_utf8(const uchar *, const int);
+static bool content_magic_is_image(const uchar *, const int);
+
 void
 content_remove_newline(char *text, int *length) {
     DEBUG_PRINT("%s, %d", text, *length);
+    if (content_strip_newlines == NULL)
+        content_select_kernels();
+
+    *length = (int) content_strip_newlines((uchar *) text, (usize) *length);
     text[*length] = '\0';
-    while (text[*length - 1] == '\n') {
-        text[*length - 1] = '\0';
-        *length -= 1;
-    }
     return;
 }
 
+/* The preview is built on the stack and copied to a slab block of the
+ * exact size, or shares content when nothing had to be trimmed. */
 void
 content_trim_spaces(char **trimmed, int *trimmed_length,
                     char *content, const int length) {
     DEBUG_PRINT("%p, %p, %s, %d",
                 (void *) trimmed, (void *) trimmed_length, content, length);
-    char *p;
-    char temp = '\0';
-    char *c = content;
+    char buffer[TRIMMED_SIZE + 1];
+    usize end = (usize) MIN(length, TRIMMED_SIZE);
+    usize start;
+    char *nul;
 
-    *trimmed = p = util_malloc(MIN((usize) length + 1, TRIMMED_SIZE + 1));
+    if (content_collapse_spaces == NULL)
+        content_select_kernels();
 
-    if (length >= TRIMMED_SIZE) {
-        temp = content[TRIMMED_SIZE];
-        content[TRIMMED_SIZE] = '\0';
-    }
-
-    while (IS_SPACE(*c))
-        c += 1;
-    while (*c != '\0') {
-        while (IS_SPACE(*c) && IS_SPACE(*(c + 1)))
-            c += 1;
-
-        *p = *c;
-        p += 1;
-        c += 1;
-    }
-    *p = '\0';
-    *trimmed_length = (int) (p - *trimmed);
+    if ((nul = memchr(content, '\0', end)))
+        end = (usize) (nul - content);
+    start = content_skip_spaces((uchar *) content, end);
 
-    if (temp) {
-        content[TRIMMED_SIZE] = temp;
-        temp = '\0';
-    }
+    *trimmed_length = (int) content_collapse_spaces(buffer, content,
+                                                    start, end);
+    buffer[*trimmed_length] = '\0';
 
     if (*trimmed_length == length) {
-        free(*trimmed);
         *trimmed = content;
     } else {
-        *trimmed = util_realloc(*trimmed, (usize) *trimmed_length + 1);
+        *trimmed = util_slab_alloc((usize) *trimmed_length + 1);
+        memcpy(*trimmed, buffer, (usize) *trimmed_length + 1);
     }
     return;
 }
@@ -76,12 +102,12 @@ int32
 content_check_content(uchar *data, const int length) {
     DEBUG_PRINT("%s, %d", data, length);
 
+    if (content_skip_spaces == NULL)
+        content_select_kernels();
+
     { /* Check if it is made only of spaces and newlines */
-        uchar *aux = data;
-        do {
-            aux += 1;
-        } while (IS_SPACE(*(aux - 1)));
-        if (*(aux - 1) == '\0') {
+        usize first = content_skip_spaces(data, (usize) length);
+        if (data[first] == '\0') {
             error("Only white space copied to clipboard. "
                   "This won't be added to history.\n");
             return CLIPBOARD_ERROR;
@@ -98,31 +124,325 @@ content_check_content(uchar *data, const int length) {
         }
     }
 
-    do {
-        magic_t magic;
-        const char *mime_type;
+    if (content_is_image(data, length))
+        return CLIPBOARD_IMAGE;
+
+    if (!content_is_utf8(data, length)
+        && content_magic_is_image(data, length)) {
+        return CLIPBOARD_IMAGE;
+    }
+
+    if (length > ENTRY_MAX_LENGTH) {
+        error("Too large entry. This wont' be added to history.\n");
+        return CLIPBOARD_ERROR;
+    }
+
+    return CLIPBOARD_TEXT;
+}
+
+/* Signatures of the image formats applications usually put in the
+ * clipboard. */
+bool
+content_is_image(const uchar *data, const int length) {
+    if ((length >= 8) && !memcmp(data, "\x89PNG\r\n\x1a\n", 8))
+        return true;
+    if ((length >= 3) && !memcmp(data, "\xff\xd8\xff", 3))
+        return true;
+    if ((length >= 6)
+        && (!memcmp(data, "GIF87a", 6) || !memcmp(data, "GIF89a", 6))) {
+        return true;
+    }
+    if ((length >= 12)
+        && !memcmp(data, "RIFF", 4) && !memcmp(data + 8, "WEBP", 4)) {
+        return true;
+    }
+    return false;
+}
+
+/* Valid UTF-8 without NUL bytes is text, no need to ask libmagic. */
+bool
+content_is_utf8(const uchar *data, const int length) {
+    const uchar *p = data;
+    const uchar *end = data + length;
+
+    while (p < end) {
+        uchar c = *p;
+        int continuation;
+        uint32 code;
+        uint32 minimum;
+
+        if (c == '\0')
+            return false;
+        if (c < 0x80) {
+            p += 1;
+            continue;
+        }
+
+        if ((c & 0xe0) == 0xc0) {
+            continuation = 1;
+            code = c & 0x1f;
+            minimum = 0x80;
+        } else if ((c & 0xf0) == 0xe0) {
+            continuation = 2;
+            code = c & 0x0f;
+            minimum = 0x800;
+        } else if ((c & 0xf8) == 0xf0) {
+            continuation = 3;
+            code = c & 0x07;
+            minimum = 0x10000;
+        } else {
+            return false;
+        }
+        if ((end - p) <= continuation)
+            return false;
+
+        for (int i = 1; i <= continuation; i += 1) {
+            if ((p[i] & 0xc0) != 0x80)
+                return false;
+            code = (code << 6) | (p[i] & 0x3f);
+        }
+        if ((code < minimum) || (code > 0x10ffff)
+            || ((code >= 0xd800) && (code <= 0xdfff))) {
+            return false;
+        }
+        p += continuation + 1;
+    }
+    return true;
+}
+
+bool
+content_magic_is_image(const uchar *data, const int length) {
+    DEBUG_PRINT("%p, %d", (void *) data, length);
+    const char *mime_type;
+
+    if (magic_failed)
+        return false;
+    if (magic == NULL) {
         if ((magic = magic_open(MAGIC_MIME_TYPE)) == NULL) {
-            break;
+            error("Error opening libmagic: %s\n", strerror(errno));
+            magic_failed = true;
+            return false;
         }
         if (magic_load(magic, NULL) != 0) {
+            error("Error loading magic database: %s\n", magic_error(magic));
             magic_close(magic);
-            break;
+            magic = NULL;
+            magic_failed = true;
+            return false;
         }
-        if ((mime_type = magic_buffer(magic, data, (usize) length)) == NULL) {
-            magic_close(magic);
-            break;
+    }
+
+    if ((mime_type = magic_buffer(magic, data, (usize) length)) == NULL)
+        return false;
+    return !strncmp(mime_type, "image/", 6);
+}
+
+void
+content_select_kernels(void) {
+    DEBUG_PRINT("void");
+    if (content_use_kernels(CONTENT_KERNELS_AVX2))
+        return;
+    if (content_use_kernels(CONTENT_KERNELS_SSE2))
+        return;
+    content_use_kernels(CONTENT_KERNELS_SCALAR);
+    return;
+}
+
+/* Use the kernels of level instead of the best ones for this CPU, so
+ * that clipsim-bench can compare them. Returns false, changing nothing,
+ * if the CPU can't run them. */
+bool
+content_use_kernels(const int32 level) {
+    DEBUG_PRINT("%d", level);
+    switch (level) {
+    case CONTENT_KERNELS_SCALAR:
+        content_skip_spaces = content_skip_spaces_scalar;
+        content_strip_newlines = content_strip_newlines_scalar;
+        content_collapse_spaces = content_collapse_spaces_scalar;
+        return true;
+#ifdef CONTENT_X86
+    case CONTENT_KERNELS_SSE2:
+        content_skip_spaces = content_skip_spaces_sse2;
+        content_strip_newlines = content_strip_newlines_sse2;
+        content_collapse_spaces = content_collapse_spaces_sse2;
+        return true;
+    case CONTENT_KERNELS_AVX2:
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("avx2"))
+            return false;
+        content_skip_spaces = content_skip_spaces_avx2;
+        content_strip_newlines = content_strip_newlines_avx2;
+        content_collapse_spaces = content_collapse_spaces_avx2;
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+/* Index of the first byte that is not a space, or length. */
+usize
+content_skip_spaces_scalar(const uchar *data, const usize length) {
+    usize i = 0;
+    while ((i < length) && IS_SPACE(data[i]))
+        i += 1;
+    return i;
+}
+
+/* Length of text without its trailing newlines. */
+usize
+content_strip_newlines_scalar(const uchar *text, usize length) {
+    while ((length > 0) && (text[length - 1] == '\n'))
+        length -= 1;
+    return length;
+}
+
+/* Copy content[start, end) to buffer, replacing each run of spaces with
+ * its last character. Returns how many bytes were written. */
+usize
+content_collapse_spaces_scalar(char *buffer, const char *content,
+                               usize start, const usize end) {
+    char *p = buffer;
+
+    for (usize i = start; i < end; i += 1) {
+        if ((i + 1 < end) && IS_SPACE(content[i]) && IS_SPACE(content[i + 1]))
+            continue;
+        *p = content[i];
+        p += 1;
+    }
+    return (usize) (p - buffer);
+}
+
+#ifdef CONTENT_X86
+/* Bit i of the result is set when byte i of the block is a space. */
+#define SPACES_SSE2(block)                                           \
+    ((uint32) _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(           \
+        _mm_cmpeq_epi8(block, _mm_set1_epi8(' ')),                   \
+        _mm_cmpeq_epi8(block, _mm_set1_epi8('\t'))),                 \
+        _mm_cmpeq_epi8(block, _mm_set1_epi8('\n')))))
+#define SPACES_AVX2(block)                                           \
+    ((uint32) _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(  \
+        _mm256_cmpeq_epi8(block, _mm256_set1_epi8(' ')),             \
+        _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\t'))),           \
+        _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n')))))
+
+usize
+content_skip_spaces_sse2(const uchar *data, const usize length) {
+    usize i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (data + i));
+        uint32 spaces = SPACES_SSE2(block);
+        if (spaces != 0xffff)
+            return i + (usize) __builtin_ctz(~spaces);
+    }
+    return i + content_skip_spaces_scalar(data + i, length - i);
+}
+
+usize
+content_strip_newlines_sse2(const uchar *text, usize length) {
+    const __m128i newline = _mm_set1_epi8('\n');
+
+    while (length >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (text + length - 16));
+        uint32 newlines = (uint32) _mm_movemask_epi8(_mm_cmpeq_epi8(block,
+                                                                    newline));
+        if (newlines != 0xffff)
+            return length - (usize) __builtin_clz(~newlines << 16);
+        length -= 16;
+    }
+    return content_strip_newlines_scalar(text, length);
+}
+
+/* Blocks without two spaces in a row are copied whole, the others byte
+ * by byte following the mask of bytes to drop. */
+usize
+content_collapse_spaces_sse2(char *buffer, const char *content,
+                             usize start, const usize end) {
+    char *p = buffer;
+    usize i = start;
+
+    for (; i + 16 < end; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (content + i));
+        __m128i next = _mm_loadu_si128((const __m128i *) (content + i + 1));
+        uint32 drop = SPACES_SSE2(block) & SPACES_SSE2(next);
+
+        if (drop == 0) {
+            _mm_storeu_si128((__m128i *) p, block);
+            p += 16;
+            continue;
         }
-        if (!strncmp(mime_type, "image/", 6)) {
-            magic_close(magic);
-            return CLIPBOARD_IMAGE;
+        for (int j = 0; j < 16; j += 1) {
+            if (!(drop & (1u << j))) {
+                *p = content[i + (usize) j];
+                p += 1;
+            }
         }
-        magic_close(magic);
-    } while (0);
+    }
+    p += content_collapse_spaces_scalar(p, content, i, end);
+    return (usize) (p - buffer);
+}
 
-    if (length > (ENTRY_MAX_LENGTH - 1)) {
-        error("Too large entry. This wont' be added to history.\n");
-        return CLIPBOARD_ERROR;
+__attribute__((target("avx2")))
+usize
+content_skip_spaces_avx2(const uchar *data, const usize length) {
+    usize i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (data + i));
+        uint32 spaces = SPACES_AVX2(block);
+        if (spaces != 0xffffffff)
+            return i + (usize) __builtin_ctz(~spaces);
+    }
+    _mm256_zeroupper();
+    return i + content_skip_spaces_sse2(data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+usize
+content_strip_newlines_avx2(const uchar *text, usize length) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+
+    while (length >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)
+                                           (text + length - 32));
+        uint32 newlines = (uint32) _mm256_movemask_epi8(
+                              _mm256_cmpeq_epi8(block, newline));
+        if (newlines != 0xffffffff)
+            return length - (usize) __builtin_clz(~newlines);
+        length -= 32;
     }
+    _mm256_zeroupper();
+    return content_strip_newlines_sse2(text, length);
+}
 
-    return CLIPBOARD_TEXT;
+__attribute__((target("avx2")))
+usize
+content_collapse_spaces_avx2(char *buffer, const char *content,
+                             usize start, const usize end) {
+    char *p = buffer;
+    usize i = start;
+
+    for (; i + 32 < end; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (content + i));
+        __m256i next = _mm256_loadu_si256((const __m256i *)
+                                          (content + i + 1));
+        uint32 drop = SPACES_AVX2(block) & SPACES_AVX2(next);
+
+        if (drop == 0) {
+            _mm256_storeu_si256((__m256i *) p, block);
+            p += 32;
+            continue;
+        }
+        for (int j = 0; j < 32; j += 1) {
+            if (!(drop & (1u << j))) {
+                *p = content[i + (usize) j];
+                p += 1;
+            }
+        }
+    }
+    _mm256_zeroupper();
+    p += content_collapse_spaces_sse2(p, content, i, end);
+    return (usize) (p - buffer);
 }
+#endif
@@ -17,18 +17,222 @@
 
 #include "clipsim.h"
 
-static volatile bool recovered = false;
+#define JOURNAL_MIN_RECORDS 512
+#define PAGE_SHIFT 10
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define VIEW_PAGE_SHIFT 8
+#define VIEW_PAGE_SIZE (1 << VIEW_PAGE_SHIFT)
+#define INDEX_MIN_SIZE 256
+#define SEQUENCE_MIN_SIZE 1024
+#define LISTING_ID_SIZE 16
+#define HISTORY_MAGIC "CLIPSIM"
+#define HISTORY_VERSION 1
+#define HISTORY_VERSION_COMPRESSED 2
+#define HISTORY_BLOCK_SIZE (1 << 16)
+#define HISTORY_DICTIONARY_SIZE (1 << 15)
+#define HISTORY_DICTIONARY_ENTRY 1024
+#define HISTORY_SAVE_INTERVAL 1000000000ull
+#define UNSYNCED_IMAGES_MAX 64
+
+/* Snapshot layout: header, then one HistoryRecord per entry (oldest
+ * first), then the contents they point to. The header checksum covers
+ * the record table and each record has a checksum of its content. */
+typedef struct HistoryHeader {
+    char magic[8];
+    uint32 version;
+    uint32 count;
+    uint64 checksum;
+} HistoryHeader;
+
+typedef struct HistoryRecord {
+    uint64 offset;
+    uint32 length;
+    uint32 kind;
+    uint64 hash;
+    uint64 checksum;
+} HistoryRecord;
+
+/* Compressed snapshots (CLIPSIM_COMPRESSION) have record offsets into
+ * the uncompressed contents, which are split in blocks of whole entries
+ * compressed with raw deflate. The first block holds the newest short
+ * entries and is the preset dictionary of the others, so short entries,
+ * which compress poorly on their own, share what they have in common
+ * with recent ones without storing anything twice. After the record
+ * table come a HistoryBlocks and the table of blocks, all covered by the
+ * header checksum, and then the blocks. */
+typedef struct HistoryBlocks {
+    uint32 count;
+    uint32 unused;
+    uint64 raw_length;
+} HistoryBlocks;
+
+typedef struct HistoryBlock {
+    uint64 offset;
+    uint32 length;
+    uint32 raw_length;
+} HistoryBlock;
+
+/* What a save writes, taken with lock held: a view of the entries and
+ * how far the journal went. */
+typedef struct Snapshot {
+    HistoryView *view;
+    int32 journal_records;
+    off_t journal_size;
+} Snapshot;
+
+/* Contents freed while some view can still see them, freed for real once
+ * every view up to generation is released. The file of an image, whose
+ * content is its path, is removed then too, unless it was copied again
+ * meanwhile. */
+typedef struct Retired {
+    char *data;
+    usize size;
+    uint64 generation;
+    uint64 image_hash;
+    bool image;
+} Retired;
+
+/* Readers see the history through pages of entry copies indexed by
+ * sequence number, an unlinked one having NULL content. A view takes a
+ * reference to every page with lock held and puts the entries in id
+ * order without it, see history_view_entries(). A page a view can see is
+ * copied before the history changes it, so taking views after changes
+ * copies the pages that changed and nothing else. */
+typedef struct ViewPage {
+    int32 references;
+    int32 live;
+    Entry entries[VIEW_PAGE_SIZE];
+} ViewPage;
+
+/* The journal starts with the identity of the snapshot it applies to. */
+typedef struct JournalBase {
+    uint64 inode;
+    uint64 size;
+} JournalBase;
+
+/* Entries live in fixed slots, allocated a page at a time, and never
+ * move. They are chained from oldest to newest through their older/newer
+ * links, and unused slots are chained through newer starting at
+ * free_slot. Ids seen by clients are positions in that chain, 0 being
+ * the oldest entry.
+ *
+ * Every linked entry takes the next sequence number, and a Fenwick tree
+ * over sequence numbers counts live entries, so ids and slots are
+ * converted in O(log n). Sequence numbers are reassigned when they run
+ * out, which costs O(n) once every n insertions. */
+
+/* The id prefixes of --print ("000 " and so on) are written once, a
+ * page of them at a time, and never move, so that a view pairs them with
+ * the entry previews for writev() without formatting anything and no
+ * change to the history has to touch them. */
+static Entry **pages = NULL;
+static int32 npages = 0;
+static int32 slots_used = 0;
+static int32 capacity = HISTORY_BUFFER_SIZE;
+static int32 oldest = -1;
+static int32 newest = -1;
+static int32 free_slot = -1;
 static int32 lastindex;
+static usize content_bytes = 0;
+static int32 *fenwick = NULL;
+static int32 *sequence_slot = NULL;
+static int32 sequence_size = 0;
+static int32 next_sequence = 0;
 static File history = { .file = NULL, .fd = -1, .name = NULL };
+static File journal = { .file = NULL, .fd = -1, .name = NULL };
+static char *journal_next = NULL;
 static char *XDG_CACHE_HOME = NULL;
-static uint8 length_counts[ENTRY_MAX_LENGTH] = {0};
-
-static int32 history_repeated_index(const char *, const int);
+static int32 *hash_index = NULL;
+static usize index_size = 0;
+static int32 journal_records = 0;
+static JournalRecord *pending = NULL;
+static const char **pending_payloads = NULL;
+static int32 pending_count = 0;
+static int32 pending_size = 0;
+static int *unsynced_images = NULL;
+static int32 unsynced_images_count = 0;
+static int32 unsynced_images_size = 0;
+static bool journal_unsynced = false;
+static int compression = 0;
+static thrd_t writer;
+static cnd_t save_wanted;
+static cnd_t save_done;
+static bool writer_running = false;
+static bool saving = false;
+static uint64 saves_asked = 0;
+static uint64 saves_done = 0;
+static bool save_result = false;
+static int save_notify = -1;
+static bool syncing = false;
+static HistoryView *view = NULL;
+static ViewPage **view_pages = NULL;
+static int32 view_npages = 0;
+static HistoryView *views_oldest = NULL;
+static HistoryView *views_newest = NULL;
+static uint64 view_generation = 0;
+static Retired *retired = NULL;
+static int32 retired_count = 0;
+static int32 retired_size = 0;
+static char *prefixes[HISTORY_MAX_SIZE >> PAGE_SHIFT];
+static int32 prefix_pages = 0;
+
+static uint64 history_hash(const char *, int, const int32);
+static uint64 history_hash_file(const char *);
+static void history_index_insert(const int32);
+static void history_index_delete(const int32);
+static void history_index_resize(const usize);
+static void history_store_init(void);
+static Entry *history_at(const int32);
+static int32 history_alloc_slot(void);
+static int32 history_slot(const int32);
+static void history_fenwick_add(int32, const int32);
+static int32 history_fenwick_select(int32);
+static int32 history_fenwick_rank(int32);
+static void history_renumber(void);
+static bool history_journal_full(void);
+static void history_unlink(const int32);
+static void history_link_newest(const int32);
+static void history_prefixes_grow(const int32);
+static void history_evict(void);
+static int32 history_find_hash(const uint64);
+static void history_new_entry(char *, const int, const int32, const uint64);
+static void history_delete(const int32);
+static bool history_load_snapshot(void);
+static int history_writer(void *);
+static void history_snapshot(Snapshot *);
+static bool history_write(const Snapshot *);
+static bool history_write_plain(const Snapshot *);
+static bool history_write_compressed(const Snapshot *);
+static bool history_publish(const Snapshot *);
+static void history_compact(void);
+static void history_view_stale(void);
+static ViewPage *history_view_page(const int32);
+static void history_view_set(const Entry *);
+static void history_view_clear(const int32);
+static void history_view_drop(ViewPage **, const int32);
+static void history_retire(char *, const usize, const Entry *);
+static void history_reclaim(void);
+static void history_load_binary(char *, const usize);
+static void history_load_compressed(char *, const usize, const HistoryHeader *);
+static void history_load_records(char *, const uint32, char *, const usize);
+static void history_load_legacy(char *, const usize);
+static bool history_journal_replay(void);
+static bool history_journal_base(const char *, const usize);
+static void history_journal_recover(void);
+static void history_journal_apply(JournalRecord *, char *);
+static void history_journal_record(const uint8, const uint8, const uint64,
+                                   const char *, const uint32);
+static bool history_journal_write(void);
+static void history_journal_sync(void);
+static void history_sync_images(int *, const int32);
+static void history_writer_wait(const uint64);
+static uint64 history_journal_checksum(JournalRecord *, const char *);
 static void history_reorder(const int32);
+static void history_raise(const int32 *, const int32);
 static void history_free_entry(const Entry *);
-static void history_clean(void);
-static void history_save_image(char **, int *);
-static void history_save_entry(Entry *, int);
+static bool history_save_image(char **, int *, const uint64);
+static bool history_dedup(char *, const int, const uint64, const int32);
+static void history_insert(char *, int, const int32, const uint64);
 
 int32
 history_lastindex(void) {
@@ -36,105 +240,777 @@ history_lastindex(void) {
     return lastindex;
 }
 
+/* Memory held by the contents and previews of the entries, kept as they
+ * come and go so that stats need not walk the history. */
+usize
+history_content_bytes(void) {
+    DEBUG_PRINT("void");
+    return content_bytes;
+}
+
+/* Compaction: the whole history is written to an unnamed file which
+ * then replaces the snapshot (see util_create_open), and the journal
+ * starts over from the new snapshot. A crash at any point leaves either
+ * the old snapshot and its journal or the new snapshot and its journal,
+ * see history_publish. Called with lock held, it waits for the writer
+ * thread if it is in the middle of a save. */
+bool
+history_save(void) {
+    DEBUG_PRINT("void");
+    Snapshot snapshot;
+    bool saved;
+    uint64 start = stats_now();
+
+    if (history.name == NULL) {
+        error("History file name unresolved, can't save history.");
+        return false;
+    }
+
+    while (saving || syncing)
+        stats_wait(&save_done, NULL);
+
+    history_snapshot(&snapshot);
+    history_sync_images(unsynced_images, unsynced_images_count);
+    unsynced_images = NULL;
+    unsynced_images_count = unsynced_images_size = 0;
+    saved = history_write(&snapshot) && history_publish(&snapshot);
+    history_view_release(snapshot.view);
+    if (saved) {
+        error("History saved to disk.\n");
+        stats_record(STATS_SAVE, start);
+    }
+    return saved;
+}
+
+/* Called with lock held, for --save. The writer thread saves like it
+ * compacts, and this only asks it to, returning a ticket for
+ * history_saved(). notify, an eventfd, is written every time the writer
+ * is done with a save. Without the writer thread the save is done here,
+ * and notify is written all the same. */
+uint64
+history_save_ask(const int notify) {
+    DEBUG_PRINT("%d", notify);
+    uint64 one = 1;
+
+    save_notify = notify;
+    saves_asked += 1;
+    if (writer_running) {
+        cnd_signal(&save_wanted);
+        return saves_asked;
+    }
+
+    save_result = history_save();
+    saves_done = saves_asked;
+    if (write(notify, &one, sizeof (one)) < 0)
+        error("Error waking history save waiter: %s\n", strerror(errno));
+    return saves_asked;
+}
+
+/* Called with lock held. -1 while the save of ticket is still to be
+ * done, else whether it went well. */
+int
+history_saved(const uint64 ticket) {
+    if (saves_done < ticket)
+        return -1;
+    return save_result;
+}
+
+/* Once the daemon is up, syncs and compactions are done by this thread,
+ * so that only writing journal records, taking the snapshot and swapping
+ * files hold the lock. Every journaled change wakes it, and whatever was
+ * written while it synced the last ones is synced together next. A full
+ * journal is compacted, HISTORY_SAVE_INTERVAL after the last save at the
+ * earliest, so that a slow disk sees one save at a time with everything
+ * that came in meanwhile. */
 void
-history_save_entry(Entry *e, int index) {
-    DEBUG_PRINT("{\n    %s,\n    %d,\n    %s,\n    %d\n}",
-                e->content, e->content_length, e->trimmed, e->trimmed_length);
-    char image_save[PATH_MAX];
-    usize tag_size = sizeof (*(&IMAGE_TAG));
-    isize w;
-
-    if (e->image_path) {
-        int n;
-        char *base = basename(e->image_path);
-        n = snprintf(image_save, sizeof (image_save), 
-                     "%s/clipsim/%s", XDG_CACHE_HOME, base);
-        if (n < 0) {
-            error("Error printing image path.\n");
-            return;
-        }
+history_writer_start(void) {
+    DEBUG_PRINT("void");
+    if ((cnd_init(&save_wanted) != thrd_success)
+        || (cnd_init(&save_done) != thrd_success)
+        || (thrd_create(&writer, history_writer, NULL) != thrd_success)) {
+        error("Error creating history writer thread. "
+              "Saving with lock held.\n");
+        return;
+    }
+    writer_running = true;
+    return;
+}
 
-        if (strcmp(image_save, e->image_path)) {
-            if (util_copy_file(image_save, e->image_path) < 0) {
-                error("Error copying %s to %s: %s.\n", 
-                      e->image_path, image_save, strerror(errno));
-                history_remove(index);
-                return;
-            }
+int
+history_writer(void *unused) {
+    uint64 last = 0;
+    uint64 one = 1;
+    (void) unused;
+
+    while (true) {
+        Snapshot snapshot;
+        int *images;
+        int32 nimages;
+        uint64 asked;
+        uint64 start;
+        bool saved;
+
+        stats_lock();
+        history_writer_wait(last);
+        stats_unlock();
+        start = stats_now();
+
+        /* images the snapshot points to are synced before it is, and
+         * every --save asked so far gets this one */
+        stats_lock();
+        history_snapshot(&snapshot);
+        asked = saves_asked;
+        saving = true;
+        images = unsynced_images;
+        nimages = unsynced_images_count;
+        unsynced_images = NULL;
+        unsynced_images_count = unsynced_images_size = 0;
+        stats_unlock();
+
+        history_sync_images(images, nimages);
+        saved = history_write(&snapshot);
+
+        /* so that history_publish has few images left to sync */
+        stats_lock();
+        images = unsynced_images;
+        nimages = unsynced_images_count;
+        unsynced_images = NULL;
+        unsynced_images_count = unsynced_images_size = 0;
+        stats_unlock();
+        history_sync_images(images, nimages);
+
+        stats_lock();
+        saved = saved && history_publish(&snapshot);
+        saving = false;
+        saves_done = asked;
+        save_result = saved;
+        history_view_release(snapshot.view);
+        cnd_broadcast(&save_done);
+        if ((save_notify >= 0) && (write(save_notify, &one, sizeof (one)) < 0))
+            error("Error waking history save waiter: %s\n", strerror(errno));
+        stats_unlock();
+
+        if (saved) {
+            error("History saved to disk.\n");
+            stats_record(STATS_SAVE, start);
         }
-        if (write(history.fd, image_save, (usize) n) < n) {
-            error("Error writing %s: %s\n", image_save, strerror(errno));
-            history_remove(index);
+        last = stats_now();
+    }
+    return 0;
+}
+
+/* Called with lock held, until it is time for a save, right away if
+ * one was asked. Syncs meanwhile, letting go of the lock for each. */
+void
+history_writer_wait(const uint64 last) {
+    while (true) {
+        uint64 now;
+
+        if (saves_asked > saves_done)
             return;
+        if (journal_unsynced || (unsynced_images_count > 0)) {
+            history_journal_sync();
+            continue;
         }
-        if (write(history.fd, &IMAGE_TAG, tag_size) < (isize) tag_size) {
-            error("Error writing IMAGE_TAG: %s\n", strerror(errno));
-            history_remove(index);
-            return;
+        if (!history_journal_full()) {
+            stats_wait(&save_wanted, NULL);
+            continue;
         }
-    } else {
-        int left = e->content_length;
-        int offset = 0;
-        do {
-            w = write(history.fd, e->content + offset, (usize) left);
-            left -= w;
-            offset += w;
-            if (left == 0)
-                break;
-        } while (w > 0);
-        if (w < 0) {
-            error("Error writing %s: %s\n", e->content, strerror(errno));
-            history_remove(index);
+        if ((now = stats_now()) >= last + HISTORY_SAVE_INTERVAL)
             return;
+
+        {
+            uint64 wait = last + HISTORY_SAVE_INTERVAL - now;
+            struct timespec deadline;
+
+            timespec_get(&deadline, TIME_UTC);
+            deadline.tv_sec += (time_t) (wait / 1000000000ull);
+            deadline.tv_nsec += (long) (wait % 1000000000ull);
+            if (deadline.tv_nsec >= 1000000000l) {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000l;
+            }
+            stats_wait(&save_wanted, &deadline);
         }
-        if (write(history.fd, &TEXT_TAG, tag_size) < (isize) tag_size) {
-            error("Error writing TEXT_TAG: %s\n", strerror(errno));
-            history_remove(index);
-            return;
+    }
+}
+
+/* Called with lock held at the end of every change to the history: the
+ * records it journaled are written together, then synced, and a full
+ * journal is compacted. Without the writer thread both happen here. */
+void
+history_compact(void) {
+    if (pending_count > 0)
+        history_journal_write();
+    if (writer_running) {
+        if (journal_unsynced || (unsynced_images_count > 0)
+            || history_journal_full()) {
+            cnd_signal(&save_wanted);
         }
+        return;
     }
+    if (journal_unsynced || (unsynced_images_count > 0))
+        history_journal_sync();
+    if (history_journal_full())
+        history_save();
+    return;
+}
+
+/* Called with lock held. */
+void
+history_snapshot(Snapshot *snapshot) {
+    DEBUG_PRINT("%p", (void *) snapshot);
+    snapshot->view = history_view();
+    snapshot->journal_records = journal_records;
+    snapshot->journal_size = 0;
+    if (journal.fd >= 0)
+        snapshot->journal_size = lseek(journal.fd, 0, SEEK_END);
     return;
 }
 
+/* Write the snapshot to an unnamed file, without the lock. It is synced
+ * here, so that history_publish has little left to do. */
 bool
-history_save(void) {
-    DEBUG_PRINT("void");
-    int saved;
+history_write(const Snapshot *snapshot) {
+    DEBUG_PRINT("%p", (void *) snapshot);
+    bool written;
 
-    if (lastindex < 0) {
-        error("History is empty. Not saving.\n");
+    history_view_entries(snapshot->view);
+    if (util_create_open(&history) < 0)
         return false;
+
+    if (compression > 0)
+        written = history_write_compressed(snapshot);
+    else
+        written = history_write_plain(snapshot);
+    if (!written) {
+        error("Error writing history: %s\n", strerror(errno));
+    } else if (fdatasync(history.fd) < 0) {
+        error("Error syncing history: %s\n", strerror(errno));
+        written = false;
     }
-    if (history.name == NULL) {
-        error("History file name unresolved, can't save history.");
+    if (!written)
+        util_create_abort(&history);
+    return written;
+}
+
+/* Called with lock held. The new journal starts with the identity of the
+ * written snapshot and gets a copy of what was journaled after the
+ * snapshot was taken. It is ready under journal_next before the snapshot
+ * gets its name, and history_journal_recover puts it in place if a crash
+ * comes in between. */
+bool
+history_publish(const Snapshot *snapshot) {
+    DEBUG_PRINT("%p", (void *) snapshot);
+    struct stat history_stat;
+    JournalBase base;
+    int32 records = journal_records;
+    int old = journal.fd;
+    int tail = -1;
+
+    if (fstat(history.fd, &history_stat) < 0) {
+        error("Error getting information on %s: %s\n",
+              history.name, strerror(errno));
+        util_create_abort(&history);
         return false;
     }
-    if ((history.fd = open(history.name, O_WRONLY | O_CREAT | O_TRUNC,
-                                         S_IRUSR | S_IWUSR)) < 0) {
-        error("Error opening history file for saving: %s\n", strerror(errno));
-        return false;
+    base.inode = (uint64) history_stat.st_ino;
+    base.size = (uint64) history_stat.st_size;
+
+    /* not O_APPEND, copy_file_range() refuses it, writes are in order
+     * anyway */
+    journal.fd = open(journal_next, O_WRONLY | O_CREAT | O_TRUNC,
+                                    S_IRUSR | S_IWUSR);
+    if (journal.fd < 0) {
+        error("Error opening %s: %s\n", journal_next, strerror(errno));
+        goto abort;
+    }
+    history_journal_record(JOURNAL_BASE, 0, 0, (char *) &base, sizeof (base));
+    if (!history_journal_write())
+        goto abort;
+
+    if (old >= 0) {
+        off_t end = lseek(old, 0, SEEK_END);
+        if (((tail = open(journal.name, O_RDONLY)) < 0)
+            || (lseek(tail, snapshot->journal_size, SEEK_SET) < 0)
+            || (util_copy_range(journal.fd, tail,
+                                (usize) MAX(end - snapshot->journal_size, 0)) < 0)) {
+            error("Error copying %s: %s\n", journal.name, strerror(errno));
+            goto abort;
+        }
+        close(tail);
+        tail = -1;
+    }
+    /* the tail can point to images saved after the snapshot was taken,
+     * which must be on disk before it is */
+    history_sync_images(unsynced_images, unsynced_images_count);
+    unsynced_images = NULL;
+    unsynced_images_count = unsynced_images_size = 0;
+    if (fdatasync(journal.fd) < 0) {
+        error("Error syncing %s: %s\n", journal_next, strerror(errno));
+        goto abort;
     }
 
-    for (int i = 0; i <= lastindex; i += 1)
-        history_save_entry(&entries[i], i);
+    if (!util_create_commit(&history))
+        goto abort;
+    if (rename(journal_next, journal.name) < 0) {
+        util_die_notify("Error renaming %s to %s: %s\n",
+                        journal_next, journal.name, strerror(errno));
+    }
 
-    if ((saved = fsync(history.fd)) < 0)
-        error("Error saving history to disk: %s\n", strerror(errno));
-    else
-        error("History saved to disk.\n");
+    if (old >= 0)
+        close(old);
+    journal_records = records - snapshot->journal_records;
+    journal_unsynced = false;
     util_close(&history);
-    return saved >= 0;
+    return true;
+
+    abort:
+    if (tail >= 0)
+        close(tail);
+    if (journal.fd >= 0) {
+        close(journal.fd);
+        unlink(journal_next);
+    }
+    journal.fd = old;
+    journal_records = records;
+    util_create_abort(&history);
+    return false;
+}
+
+/* Readers take a view with lock held and use it without: the view
+ * shares the pages of entries, and the contents they point to are not
+ * freed until every view that can see them is released. Views are shared
+ * until the history changes, so a burst of requests between two copies
+ * makes one. Taking a view costs a reference per page. */
+HistoryView *
+history_view(void) {
+    if (view == NULL) {
+        int32 npages = MIN((next_sequence + VIEW_PAGE_SIZE - 1) >> VIEW_PAGE_SHIFT,
+                           view_npages);
+
+        view = util_calloc(1, sizeof (*view));
+        view->pages = util_malloc((usize) MAX(npages, 1)*sizeof (*(view->pages)));
+        for (int32 i = 0; i < npages; i += 1) {
+            view->pages[i] = view_pages[i];
+            if (view->pages[i])
+                view->pages[i]->references += 1;
+        }
+        view->npages = npages;
+        if (mtx_init(&view->build, mtx_plain) != thrd_success)
+            util_die_notify("Error initializing view lock.\n");
+
+        view_generation += 1;
+        view->generation = view_generation;
+        view->count = lastindex + 1;
+        view->references = 1;
+        view->newer = NULL;
+        if (views_newest)
+            views_newest->newer = view;
+        else
+            views_oldest = view;
+        views_newest = view;
+    }
+    view->references += 1;
+    return view;
+}
+
+/* Called without the lock before using the entries or the listing of v,
+ * which are put together by the first reader of the view to need them.
+ * Pages the view holds never change. */
+void
+history_view_entries(HistoryView *v) {
+    int32 count = v->count;
+    int32 id = 0;
+
+    mtx_lock(&v->build);
+    if (v->built) {
+        mtx_unlock(&v->build);
+        return;
+    }
+
+    v->entries = util_malloc((usize) MAX(count, 1)*sizeof (*(v->entries)));
+    v->listing = util_malloc((usize) MAX(count, 1)*2*sizeof (*(v->listing)));
+    for (int32 i = 0; (i < v->npages) && (id < count); i += 1) {
+        const ViewPage *page = v->pages[i];
+        if ((page == NULL) || (page->live == 0))
+            continue;
+        for (int32 j = 0; j < VIEW_PAGE_SIZE; j += 1) {
+            if (page->entries[j].content)
+                v->entries[id++] = page->entries[j];
+        }
+    }
+    for (int32 pair = 0; pair < count; pair += 1) {
+        char *prefix;
+        id = count - 1 - pair;
+        prefix = prefixes[id >> PAGE_SHIFT]
+                 + (usize) (id & (PAGE_SIZE - 1))*LISTING_ID_SIZE;
+        v->listing[2*pair] = (struct iovec) {
+            .iov_base = prefix,
+            .iov_len = strlen(prefix),
+        };
+        v->listing[2*pair + 1] = (struct iovec) {
+            .iov_base = v->entries[id].trimmed,
+            .iov_len = (usize) v->entries[id].trimmed_length + 1,
+        };
+    }
+
+    v->built = true;
+    mtx_unlock(&v->build);
+    return;
+}
+
+/* Called with lock held. */
+void
+history_view_release(HistoryView *v) {
+    HistoryView **link = &views_oldest;
+    HistoryView *older = NULL;
+
+    if ((v->references -= 1) > 0)
+        return;
+
+    while (*link != v) {
+        older = *link;
+        link = &older->newer;
+    }
+    *link = v->newer;
+    if (views_newest == v)
+        views_newest = older;
+
+    history_view_drop(v->pages, v->npages);
+    mtx_destroy(&v->build);
+    free(v->pages);
+    free(v->entries);
+    free(v->listing);
+    free(v);
+    history_reclaim();
+    return;
+}
+
+/* Let go of pages, freeing those nothing else holds. */
+void
+history_view_drop(ViewPage **drop, const int32 npages) {
+    for (int32 i = 0; i < npages; i += 1) {
+        if (drop[i] && ((drop[i]->references -= 1) == 0))
+            free(drop[i]);
+    }
+    return;
+}
+
+/* The page of sequence, ready to be changed: copied first if some view
+ * holds it. */
+ViewPage *
+history_view_page(const int32 sequence) {
+    int32 n = sequence >> VIEW_PAGE_SHIFT;
+    ViewPage *page;
+
+    if (n >= view_npages) {
+        int32 npages = MAX(view_npages*2, n + 1);
+        view_pages = util_realloc(view_pages,
+                                  (usize) npages*sizeof (*view_pages));
+        memset(&view_pages[view_npages], 0,
+               (usize) (npages - view_npages)*sizeof (*view_pages));
+        view_npages = npages;
+    }
+
+    if ((page = view_pages[n]) == NULL) {
+        page = util_calloc(1, sizeof (*page));
+        page->references = 1;
+        view_pages[n] = page;
+    } else if (page->references > 1) {
+        page->references -= 1;
+        page = util_memdup(page, sizeof (*page));
+        page->references = 1;
+        view_pages[n] = page;
+    }
+    return page;
+}
+
+/* Called with lock held, once e has its sequence number. */
+void
+history_view_set(const Entry *e) {
+    ViewPage *page = history_view_page(e->sequence);
+    page->entries[e->sequence & (VIEW_PAGE_SIZE - 1)] = *e;
+    page->live += 1;
+    return;
+}
+
+void
+history_view_clear(const int32 sequence) {
+    ViewPage *page = history_view_page(sequence);
+    page->entries[sequence & (VIEW_PAGE_SIZE - 1)].content = NULL;
+    page->live -= 1;
+    return;
+}
+
+/* The history changed, the next reader gets a new view. */
+void
+history_view_stale(void) {
+    HistoryView *v = view;
+    if (v == NULL)
+        return;
+    view = NULL;
+    history_view_release(v);
+    return;
+}
+
+/* Called with lock held. Views made from now on can't see data. */
+void
+history_retire(char *data, const usize size, const Entry *image) {
+    if (retired_count == retired_size) {
+        retired_size = MAX(retired_size*2, HISTORY_BUFFER_SIZE);
+        retired = util_realloc(retired,
+                               (usize) retired_size*sizeof (*retired));
+    }
+    retired[retired_count].data = data;
+    retired[retired_count].size = size;
+    retired[retired_count].generation = view_generation;
+    retired[retired_count].image_hash = image ? image->hash : 0;
+    retired[retired_count].image = image != NULL;
+    retired_count += 1;
+    return;
+}
+
+/* Free what no view can see anymore. Retired data is in generation
+ * order, and views are released in any order, so this stops at the
+ * oldest view still in use. */
+void
+history_reclaim(void) {
+    uint64 oldest_generation = views_oldest ? views_oldest->generation : UINT64_MAX;
+    int32 n = 0;
+
+    while ((n < retired_count) && (retired[n].generation < oldest_generation)) {
+        Retired *r = &retired[n];
+        if (r->image && ((lastindex < 0)
+                         || (history_repeated_index(r->image_hash, r->data,
+                                                    (int) r->size - 1,
+                                                    CLIPBOARD_IMAGE) < 0))) {
+            unlink(r->data);
+        }
+        util_slab_free(r->data, r->size);
+        n += 1;
+    }
+    if (n == 0)
+        return;
+    retired_count -= n;
+    memmove(retired, retired + n, (usize) retired_count*sizeof (*retired));
+    return;
+}
+
+bool
+history_write_plain(const Snapshot *snapshot) {
+    DEBUG_PRINT("%p", (void *) snapshot);
+    int32 count = snapshot->view->count;
+    usize offset;
+    bool saved;
+    HistoryHeader header = {
+        .magic = HISTORY_MAGIC,
+        .version = HISTORY_VERSION,
+        .count = (uint32) count,
+    };
+    HistoryRecord *records = util_calloc((usize) count + 1, sizeof (*records));
+    struct iovec *iov = util_calloc((usize) count + 2, sizeof (*iov));
+
+    offset = sizeof (header) + (usize) count*sizeof (*records);
+    for (int32 i = 0; i < count; i += 1) {
+        const Entry *e = &snapshot->view->entries[i];
+        records[i].offset = offset;
+        records[i].length = (uint32) e->content_length;
+        records[i].kind = e->image_path ? CLIPBOARD_IMAGE : CLIPBOARD_TEXT;
+        records[i].hash = e->hash;
+        records[i].checksum = util_hash(e->content, records[i].length);
+        iov[i + 2].iov_base = e->content;
+        iov[i + 2].iov_len = records[i].length;
+        offset += records[i].length;
+    }
+    header.checksum = util_hash(records, (usize) count*sizeof (*records));
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof (header);
+    iov[1].iov_base = records;
+    iov[1].iov_len = (usize) count*sizeof (*records);
+
+    saved = util_writev_all(history.fd, iov, count + 2);
+    free(records);
+    free(iov);
+    return saved;
+}
+
+/* Entries are laid out as the dictionary block followed by the others in
+ * order, see HistoryBlocks. */
+bool
+history_write_compressed(const Snapshot *snapshot) {
+    DEBUG_PRINT("%p", (void *) snapshot);
+    int32 count = snapshot->view->count;
+    HistoryHeader header = {
+        .magic = HISTORY_MAGIC,
+        .version = HISTORY_VERSION_COMPRESSED,
+        .count = (uint32) count,
+    };
+    const Entry *entries = snapshot->view->entries;
+    int32 *order = util_malloc((usize) MAX(count, 1)*sizeof (*order));
+    int32 *first = util_malloc(((usize) count + 2)*sizeof (*first));
+    bool *dictionary = util_calloc((usize) MAX(count, 1), sizeof (*dictionary));
+    HistoryRecord *records;
+    HistoryBlocks *blocks;
+    HistoryBlock *block;
+    char *table;
+    char *preset;
+    char *output;
+    usize table_length;
+    usize output_size = 0;
+    usize output_length = 0;
+    usize raw = 0;
+    usize block_raw = 0;
+    int32 nblocks = 1;
+    int32 n = 0;
+    z_stream stream = {0};
+    struct iovec iov[3];
+    bool saved = false;
+
+    /* the newest short entries, kept in order so that they end up last
+     * in the dictionary, where deflate finds them with short distances */
+    for (int32 i = count - 1; i >= 0; i -= 1) {
+        usize length = (usize) entries[i].content_length;
+        if (length > HISTORY_DICTIONARY_ENTRY)
+            continue;
+        if (block_raw + length > HISTORY_DICTIONARY_SIZE)
+            break;
+        block_raw += length;
+        dictionary[i] = true;
+    }
+    first[0] = 0;
+    for (int32 i = 0; i < count; i += 1) {
+        if (dictionary[i])
+            order[n++] = i;
+    }
+
+    /* block b has the entries order[first[b]] to order[first[b + 1] - 1] */
+    first[1] = n;
+    block_raw = 0;
+    for (int32 i = 0; i < count; i += 1) {
+        usize length = (usize) entries[i].content_length;
+        if (dictionary[i])
+            continue;
+        if ((n > first[nblocks]) && (block_raw + length > HISTORY_BLOCK_SIZE)) {
+            nblocks += 1;
+            first[nblocks] = n;
+            block_raw = 0;
+        }
+        block_raw += length;
+        order[n++] = i;
+    }
+    if (n > first[nblocks]) {
+        nblocks += 1;
+        first[nblocks] = n;
+    }
+
+    table_length = (usize) count*sizeof (*records)
+                   + sizeof (*blocks) + (usize) nblocks*sizeof (*block);
+    table = util_calloc(1, table_length);
+    records = (HistoryRecord *) table;
+    blocks = (HistoryBlocks *) (table + (usize) count*sizeof (*records));
+    block = (HistoryBlock *) (blocks + 1);
+    blocks->count = (uint32) nblocks;
+
+    if (deflateInit2(&stream, compression, Z_DEFLATED, -MAX_WBITS,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        error("Error initializing compression.\n");
+        free(table);
+        goto out;
+    }
+
+    for (int32 b = 0; b < nblocks; b += 1) {
+        for (int32 j = first[b]; j < first[b + 1]; j += 1) {
+            const Entry *e = &entries[order[j]];
+            HistoryRecord *record = &records[order[j]];
+
+            record->offset = raw;
+            record->length = (uint32) e->content_length;
+            record->kind = e->image_path ? CLIPBOARD_IMAGE : CLIPBOARD_TEXT;
+            record->hash = e->hash;
+            record->checksum = util_hash(e->content, record->length);
+            raw += record->length;
+            block[b].raw_length += record->length;
+        }
+        output_size += deflateBound(&stream, block[b].raw_length);
+    }
+    blocks->raw_length = raw;
+
+    preset = util_malloc(MAX(block[0].raw_length, 1));
+    raw = 0;
+    for (int32 j = first[0]; j < first[1]; j += 1) {
+        const Entry *e = &entries[order[j]];
+        memcpy(preset + raw, e->content, (usize) e->content_length);
+        raw += (usize) e->content_length;
+    }
+
+    output = util_malloc(MAX(output_size, 1));
+    saved = true;
+    for (int32 b = 0; (b < nblocks) && saved; b += 1) {
+        int status = Z_OK;
+
+        deflateReset(&stream);
+        if ((b > 0) && block[0].raw_length)
+            deflateSetDictionary(&stream, (Bytef *) preset, block[0].raw_length);
+        stream.next_out = (Bytef *) output + output_length;
+        stream.avail_out = (uInt) MIN(output_size - output_length, UINT_MAX);
+
+        for (int32 j = first[b]; j <= first[b + 1]; j += 1) {
+            bool last = j == first[b + 1];
+            const Entry *e = last ? NULL : &entries[order[j]];
+
+            if (!last && (e->content_length == 0))
+                continue;
+            stream.next_in = last ? NULL : (Bytef *) e->content;
+            stream.avail_in = last ? 0 : (uInt) e->content_length;
+            status = deflate(&stream, last ? Z_FINISH : Z_NO_FLUSH);
+            if ((status != Z_OK) || stream.avail_in)
+                break;
+        }
+        if (status != Z_STREAM_END) {
+            error("Error compressing history block %d.\n", b);
+            saved = false;
+            break;
+        }
+
+        block[b].offset = sizeof (header) + table_length + output_length;
+        block[b].length = (uint32) ((char *) stream.next_out
+                                    - (output + output_length));
+        output_length += block[b].length;
+    }
+    deflateEnd(&stream);
+    free(preset);
+
+    if (saved) {
+        header.checksum = util_hash(table, table_length);
+        iov[0].iov_base = &header;
+        iov[0].iov_len = sizeof (header);
+        iov[1].iov_base = table;
+        iov[1].iov_len = table_length;
+        iov[2].iov_base = output;
+        iov[2].iov_len = output_length;
+        saved = util_writev_all(history.fd, iov, 3);
+    }
+    free(output);
+    free(table);
+
+out:
+    free(order);
+    free(first);
+    free(dictionary);
+    return saved;
 }
 
 void
 history_read(void) {
     DEBUG_PRINT("void");
-    usize history_length;
-    char *history_map;
-    char *begin;
 
     const char *clipsim = "clipsim/history";
+    const char *suffix = ".journal";
+    const char *next = ".next";
     usize length;
+    bool migrate;
 
     if ((XDG_CACHE_HOME = getenv("XDG_CACHE_HOME")) == NULL) {
         error("XDG_CACHE_HOME needs to be set.\n");
@@ -158,6 +1034,12 @@ history_read(void) {
 
         usize size = (usize) n + 1;
         history.name = util_memdup(buffer, size);
+        journal.name = util_malloc(size + strlen(suffix));
+        memcpy(journal.name, buffer, (usize) n);
+        memcpy(journal.name + n, suffix, strlen(suffix) + 1);
+        journal_next = util_malloc(size + strlen(suffix) + strlen(next));
+        memcpy(journal_next, journal.name, (usize) n + strlen(suffix));
+        memcpy(journal_next + n + strlen(suffix), next, strlen(next) + 1);
 
         char *clipsim_dir = dirname(buffer);
         if (mkdir(clipsim_dir, 0770) < 0) {
@@ -168,11 +1050,60 @@ history_read(void) {
         }
     }
 
+    history_store_init();
+    migrate = history_load_snapshot();
+    history_journal_recover();
+
+    if (!history_journal_replay() || migrate) {
+        history_save();
+    } else if ((journal.fd = open(journal.name, O_WRONLY | O_APPEND)) < 0) {
+        error("Error opening %s: %s\n", journal.name, strerror(errno));
+        history_save();
+    }
+    return;
+}
+
+/* Drop the history from memory and close the journal, so that it can be
+ * read again. Saved images are kept. */
+void
+history_close(void) {
+    DEBUG_PRINT("void");
+    if (journal_unsynced || (unsynced_images_count > 0))
+        history_journal_sync();
+    history_view_stale();
+    for (int32 slot = oldest; slot >= 0; slot = history_at(slot)->newer) {
+        Entry *e = history_at(slot);
+        if (e->trimmed != e->content)
+            util_slab_free(e->trimmed, (usize) e->trimmed_length + 1);
+        util_slab_free(e->content, (usize) e->content_length + 1);
+    }
+    slots_used = 0;
+    oldest = newest = free_slot = -1;
     lastindex = -1;
+    content_bytes = 0;
+    trigram_close();
+
+    util_close(&journal);
+    free(history.name);
+    free(journal.name);
+    free(journal_next);
+    history.name = journal.name = journal_next = NULL;
+    return;
+}
+
+/* Returns true if the file uses the old tag separated format and has to
+ * be rewritten. */
+bool
+history_load_snapshot(void) {
+    DEBUG_PRINT("void");
+    usize history_length;
+    char *history_map;
+    bool legacy;
+
     if ((history.fd = open(history.name, O_RDONLY)) < 0) {
         error("Error opening history file for reading: %s\n"
               "History will start empty.\n", strerror(errno));
-        return;
+        return false;
     }
 
     {
@@ -181,14 +1112,14 @@ history_read(void) {
             error("Error getting file information: %s\n"
                   "History will start empty.\n", strerror(errno));
             util_close(&history);
-            return;
+            return false;
         }
         history_length = (usize) history_stat.st_size;
         if (history_length <= 0) {
             error("History_length: %zu\n", history_length);
             error("History file is empty.\n");
             util_close(&history);
-            return;
+            return false;
         }
     }
 
@@ -200,39 +1131,16 @@ history_read(void) {
         error("Error mapping history file to memory: %s"
               "History will start empty.\n", strerror(errno));
         util_close(&history);
-        return;
+        return false;
     }
 
-    begin = history_map;
-    for (char *p = history_map; p < history_map + history_length; p += 1) {
-        Entry *e;
-        char c;
-
-        if ((*p == TEXT_TAG) || (*p == IMAGE_TAG)) {
-            c = *p;
-            *p = '\0';
-
-            lastindex += 1;
-            e = &entries[lastindex];
-            e->content_length = (int) (p - begin);
-            e->content = util_memdup(begin, (usize) e->content_length + 1);
-
-            if (c == IMAGE_TAG) {
-                e->trimmed = e->content;
-                e->image_path = e->content;
-                e->trimmed_length = e->content_length;
-            } else {
-                content_trim_spaces(&e->trimmed, &e->trimmed_length, 
-                                     e->content, e->content_length);
-                e->image_path = NULL;
-            }
-            begin = p + 1;
-
-            length_counts[e->content_length] += 1;
-
-            if (lastindex > HISTORY_BUFFER_SIZE)
-                break;
-        }
+    legacy = (history_length < sizeof (HistoryHeader))
+             || memcmp(history_map, HISTORY_MAGIC, sizeof (HISTORY_MAGIC));
+    if (legacy) {
+        error("Migrating history file to version %d.\n", HISTORY_VERSION);
+        history_load_legacy(history_map, history_length);
+    } else {
+        history_load_binary(history_map, history_length);
     }
 
     if (munmap(history_map, history_length) < 0) {
@@ -240,133 +1148,1049 @@ history_read(void) {
               (void *) history_map, history_length, strerror(errno));
     }
     util_close(&history);
-    return;
-}
-
-int32
-history_repeated_index(const char *content, const int length) {
-    DEBUG_PRINT("%s, %d", content, length);
-    if (length_counts[length] == 0)
-        return -1;
-    for (int32 i = lastindex; i >= 0; i -= 1) {
-        Entry *e = &entries[i];
-        if (e->content_length == length) {
-            if (!memcmp(e->content, content, (usize) length))
-                return i;
-        }
-    }
-    return -1;
+    return legacy;
 }
 
 void
-history_save_image(char **content, int *length) {
-    DEBUG_PRINT("%p, %d", (void *) content, *length);
-    time_t t = time(NULL);
-    int fp;
-    isize w = 0;
-    isize copied = 0;
-    int n;
-    char buffer[256];
-    char *directory = "/tmp/clipsim";
-
-    n = snprintf(buffer, sizeof (buffer), "%s/%lu.png", directory, t);
-    if (n < (int) strlen(directory))
-        util_die_notify("Error printing image path.\n");
-
-    buffer[sizeof (buffer) - 1] = '\0';
-    if ((fp = open(buffer, O_WRONLY | O_CREAT | O_TRUNC,
-                                      S_IRUSR | S_IWUSR)) < 0) {
-        util_die_notify("Error opening image file for saving: "
-                        "%s\n", strerror(errno));
+history_load_binary(char *map, const usize map_length) {
+    DEBUG_PRINT("%p, %zu", (void *) map, map_length);
+    HistoryHeader header;
+    usize table_length;
+
+    memcpy(&header, map, sizeof (header));
+    if (header.version == HISTORY_VERSION_COMPRESSED) {
+        history_load_compressed(map, map_length, &header);
+        return;
     }
-
-    do {
-        w = write(fp, *(content + copied), (usize) *length);
-        if (w <= 0)
-            break;
-        copied += (usize) w;
-        *length -= (usize) w;
-    } while (*length > 0);
-
-    *length = n;
-    *content = util_realloc(*content, (usize) *length + 1);
-    memcpy(*content, buffer, (usize) *length + 1);
+    if (header.version != HISTORY_VERSION) {
+        error("Unsupported history file version %u. "
+              "History will start empty.\n", header.version);
+        return;
+    }
+    table_length = (usize) header.count*sizeof (HistoryRecord);
+    if (table_length > map_length - sizeof (header)) {
+        error("History file is truncated. History will start empty.\n");
+        return;
+    }
+    if (util_hash(map + sizeof (header), table_length) != header.checksum) {
+        error("History file index is corrupted. "
+              "History will start empty.\n");
+        return;
+    }
+    history_load_records(map + sizeof (header), header.count, map, map_length);
     return;
 }
 
+/* Inflate every block in one buffer, the contents the records point to. */
 void
-history_append(char *content, int length) {
-    DEBUG_PRINT("%s, %d", content, length);
-    int32 oldindex;
-    int32 kind;
-    Entry *e;
-
-    if (!content) {
-        error("Error getting data from clipboard. Skipping entry...\n");
-        recovered = false;
+history_load_compressed(char *map, const usize map_length,
+                        const HistoryHeader *header) {
+    DEBUG_PRINT("%p, %zu, %p", (void *) map, map_length, (void *) header);
+    HistoryBlocks blocks;
+    HistoryBlock *block;
+    usize table_length;
+    usize raw_length = 0;
+    char *raw;
+    z_stream stream = {0};
+
+    table_length = (usize) header->count*sizeof (HistoryRecord);
+    if (table_length + sizeof (blocks) > map_length - sizeof (*header)) {
+        error("History file is truncated. History will start empty.\n");
         return;
     }
-    if (recovered) {
-        recovered = false;
+    memcpy(&blocks, map + sizeof (*header) + table_length, sizeof (blocks));
+    if ((blocks.count == 0)
+        || ((usize) blocks.count*sizeof (*block)
+            > map_length - sizeof (*header) - table_length - sizeof (blocks))) {
+        error("History file is truncated. History will start empty.\n");
         return;
     }
-
-    kind = content_check_content((uchar *) content, length);
-    switch (kind) {
-    case CLIPBOARD_TEXT:
-        content_remove_newline(content, &length);
-        break;
-    case CLIPBOARD_IMAGE:
-        history_save_image(&content, &length);
-        break;
-    default:
+    block = util_malloc(blocks.count*sizeof (*block));
+    memcpy(block, map + sizeof (*header) + table_length + sizeof (blocks),
+           blocks.count*sizeof (*block));
+    table_length += sizeof (blocks) + blocks.count*sizeof (*block);
+    if (util_hash(map + sizeof (*header), table_length) != header->checksum) {
+        error("History file index is corrupted. "
+              "History will start empty.\n");
+        free(block);
         return;
     }
 
-    if ((oldindex = history_repeated_index(content, length)) >= 0) {
-        error("Entry is equal to previous entry. Reordering...\n");
-        if (oldindex != lastindex)
-            history_reorder(oldindex);
-        free(content);
+    for (uint32 b = 0; b < blocks.count; b += 1)
+        raw_length += block[b].raw_length;
+    if ((raw_length != blocks.raw_length)
+        || (inflateInit2(&stream, -MAX_WBITS) != Z_OK)) {
+        error("History file blocks are corrupted. "
+              "History will start empty.\n");
+        free(block);
         return;
     }
 
-    lastindex += 1;
-    e = &entries[lastindex];
-    e->content = content;
-    e->content_length = length;
-    length_counts[length] += 1;
+    raw = util_malloc(MAX(raw_length, 1));
+    raw_length = 0;
+    for (uint32 b = 0; b < blocks.count; b += 1) {
+        char *out = raw + raw_length;
+
+        raw_length += block[b].raw_length;
+        inflateReset(&stream);
+        if ((b > 0) && block[0].raw_length)
+            inflateSetDictionary(&stream, (Bytef *) raw, block[0].raw_length);
+        if ((block[b].offset > map_length)
+            || (block[b].length > map_length - block[b].offset)) {
+            error("History block %u is out of bounds.\n", b);
+            memset(out, 0, block[b].raw_length);
+            continue;
+        }
+        stream.next_in = (Bytef *) map + block[b].offset;
+        stream.avail_in = block[b].length;
+        stream.next_out = (Bytef *) out;
+        stream.avail_out = block[b].raw_length;
+        /* its entries will fail their checksums */
+        if ((inflate(&stream, Z_FINISH) != Z_STREAM_END) || stream.avail_out) {
+            error("History block %u is corrupted.\n", b);
+            memset(out, 0, block[b].raw_length);
+        }
+    }
+    inflateEnd(&stream);
+    free(block);
 
-    switch (kind) {
-    case CLIPBOARD_TEXT:
-        content_trim_spaces(&(e->trimmed), &(e->trimmed_length), 
-                            e->content, e->content_length);
-        e->image_path = NULL;
-        break;
-    case CLIPBOARD_IMAGE:
+    history_load_records(map + sizeof (*header), header->count,
+                         raw, raw_length);
+    free(raw);
+    return;
+}
+
+/* Records point into data, checksums of contents are checked here. */
+void
+history_load_records(char *table, const uint32 count,
+                     char *data, const usize data_length) {
+    DEBUG_PRINT("%p, %u, %p, %zu", (void *) table, count,
+                                   (void *) data, data_length);
+    HistoryRecord *records = (HistoryRecord *) table;
+    uint32 first = 0;
+
+    /* keep the most recent entries if the file is larger than history */
+    if (count > (uint32) capacity)
+        first = count - (uint32) capacity;
+
+    for (uint32 i = first; i < count; i += 1) {
+        HistoryRecord record;
+        char *content;
+
+        memcpy(&record, &records[i], sizeof (record));
+        if ((record.offset > data_length)
+            || (record.length > data_length - record.offset)) {
+            error("History entry %u is out of bounds. Skipping it.\n", i);
+            continue;
+        }
+        if (util_hash(data + record.offset, record.length) != record.checksum) {
+            error("History entry %u is corrupted. Skipping it.\n", i);
+            continue;
+        }
+        if ((record.kind != CLIPBOARD_TEXT) && (record.kind != CLIPBOARD_IMAGE))
+            continue;
+        if (history_find_hash(record.hash) >= 0)
+            continue;
+
+        content = util_slab_alloc(record.length + 1);
+        memcpy(content, data + record.offset, record.length);
+        content[record.length] = '\0';
+        history_new_entry(content, (int) record.length,
+                          (int32) record.kind, record.hash);
+    }
+    return;
+}
+
+void
+history_load_legacy(char *history_map, const usize history_length) {
+    DEBUG_PRINT("%p, %zu", (void *) history_map, history_length);
+    char *begin = history_map;
+
+    for (char *p = history_map; p < history_map + history_length; p += 1) {
+        char *content;
+        uint64 hash;
+        int length;
+        char c;
+
+        if ((*p == TEXT_TAG) || (*p == IMAGE_TAG)) {
+            c = *p;
+            *p = '\0';
+
+            length = (int) (p - begin);
+            content = util_slab_alloc((usize) length + 1);
+            memcpy(content, begin, (usize) length + 1);
+            begin = p + 1;
+
+            if (c == IMAGE_TAG)
+                hash = history_hash_file(content);
+            else
+                hash = history_hash(content, length, CLIPBOARD_TEXT);
+            if (history_find_hash(hash) >= 0) {
+                util_slab_free(content, (usize) length + 1);
+                continue;
+            }
+            history_new_entry(content, length,
+                              c == IMAGE_TAG ? CLIPBOARD_IMAGE : CLIPBOARD_TEXT,
+                              hash);
+        }
+    }
+    return;
+}
+
+/* Returns false when the journal could not be applied on top of the
+ * snapshot, in which case the caller compacts to start a fresh one. */
+bool
+history_journal_replay(void) {
+    DEBUG_PRINT("void");
+    struct stat journal_stat;
+    JournalRecord record;
+    char *map;
+    usize offset = 0;
+    usize map_length;
+    int fd;
+
+    if ((fd = open(journal.name, O_RDONLY)) < 0) {
+        if (errno != ENOENT)
+            error("Error opening %s: %s\n", journal.name, strerror(errno));
+        return false;
+    }
+    if ((fstat(fd, &journal_stat) < 0) || (journal_stat.st_size <= 0)) {
+        close(fd);
+        return false;
+    }
+    map_length = (usize) journal_stat.st_size;
+    map = mmap(NULL, map_length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        error("Error mapping %s: %s\n", journal.name, strerror(errno));
+        return false;
+    }
+
+    if (!history_journal_base(map, map_length)) {
+        error("History journal does not match %s. Ignoring it.\n",
+              history.name);
+        goto stale;
+    }
+    offset = sizeof (record) + sizeof (JournalBase);
+
+    journal_records = 0;
+    while (offset + sizeof (record) <= map_length) {
+        char *payload;
+        memcpy(&record, map + offset, sizeof (record));
+        payload = map + offset + sizeof (record);
+        if ((record.length > map_length - offset - sizeof (record))
+            || (record.checksum != history_journal_checksum(&record, payload))) {
+            error("History journal is truncated at %zu. "
+                  "Discarding the rest.\n", offset);
+            break;
+        }
+        history_journal_apply(&record, payload);
+        journal_records += 1;
+        offset += sizeof (record) + record.length;
+    }
+
+    munmap(map, map_length);
+    /* a torn record must not stay in front of new ones */
+    return (offset == map_length) && !history_journal_full();
+
+    stale:
+    munmap(map, map_length);
+    return false;
+}
+
+/* Whether the journal starting at map was written for the snapshot. */
+bool
+history_journal_base(const char *map, const usize map_length) {
+    DEBUG_PRINT("%p, %zu", (void *) map, map_length);
+    struct stat history_stat;
+    JournalRecord record;
+    JournalBase base;
+
+    if (map_length < sizeof (record) + sizeof (base))
+        return false;
+    memcpy(&record, map, sizeof (record));
+    memcpy(&base, map + sizeof (record), sizeof (base));
+    if ((record.type != JOURNAL_BASE) || (record.length != sizeof (base))
+        || (record.checksum != history_journal_checksum(&record,
+                                                        map + sizeof (record))))
+        return false;
+    if (stat(history.name, &history_stat) < 0)
+        return false;
+    return (base.inode == (uint64) history_stat.st_ino)
+           && (base.size == (uint64) history_stat.st_size);
+}
+
+/* A save that stopped right after replacing the snapshot left the
+ * journal that goes with it in journal_next. Any other one is from a
+ * snapshot that never got its name. */
+void
+history_journal_recover(void) {
+    DEBUG_PRINT("void");
+    char head[sizeof (JournalRecord) + sizeof (JournalBase)];
+    bool match;
+    int fd;
+
+    if ((fd = open(journal_next, O_RDONLY)) < 0)
+        return;
+    match = (read(fd, head, sizeof (head)) == (isize) sizeof (head))
+            && history_journal_base(head, sizeof (head));
+    close(fd);
+
+    if (match && (rename(journal_next, journal.name) == 0))
+        return;
+    unlink(journal_next);
+    return;
+}
+
+void
+history_journal_apply(JournalRecord *record, char *payload) {
+    DEBUG_PRINT("%d, %p", record->type, (void *) payload);
+    char *content;
+    int32 slot;
+
+    switch (record->type) {
+    case JOURNAL_APPEND:
+        if ((slot = history_find_hash(record->hash)) >= 0) {
+            if (slot != newest)
+                history_reorder(slot);
+            break;
+        }
+        content = util_slab_alloc(record->length + 1);
+        memcpy(content, payload, record->length);
+        content[record->length] = '\0';
+        history_new_entry(content, (int) record->length,
+                          record->kind, record->hash);
+        break;
+    case JOURNAL_REORDER:
+        slot = history_find_hash(record->hash);
+        if ((slot >= 0) && (slot != newest))
+            history_reorder(slot);
+        break;
+    case JOURNAL_REMOVE:
+        if ((slot = history_find_hash(record->hash)) >= 0)
+            history_delete(slot);
+        break;
+    default:
+        error("Unknown journal record type %d.\n", record->type);
+    }
+    return;
+}
+
+/* Records wait for the end of the change they are part of, see
+ * history_compact, so that a crash never leaves half of one in the
+ * journal. payload has to stay valid until then. */
+void
+history_journal_record(const uint8 type, const uint8 kind, const uint64 hash,
+                       const char *payload, const uint32 length) {
+    DEBUG_PRINT("%d, %d, %lu, %p, %u", type, kind, hash,
+                (void *) payload, length);
+    JournalRecord *record;
+
+    /* nothing is journaled while the journal is replayed */
+    if (journal.fd < 0)
+        return;
+
+    if (pending_count >= pending_size) {
+        pending_size = MAX(pending_size*2, 16);
+        pending = util_realloc(pending,
+                               (usize) pending_size*sizeof (*pending));
+        pending_payloads = util_realloc(pending_payloads,
+                                        (usize) pending_size
+                                        *sizeof (*pending_payloads));
+    }
+    record = &pending[pending_count];
+    memset(record, 0, sizeof (*record));
+    record->type = type;
+    record->kind = kind;
+    record->length = length;
+    record->hash = hash;
+    record->checksum = history_journal_checksum(record, payload);
+    pending_payloads[pending_count] = payload;
+    pending_count += 1;
+    return;
+}
+
+/* Write the pending records with a single writev(), records without
+ * payload sharing one iovec, and leave syncing them for later. Called
+ * with lock held. */
+bool
+history_journal_write(void) {
+    DEBUG_PRINT("void");
+    struct iovec *iov = util_malloc((usize) pending_count*2*sizeof (*iov));
+    int32 count = pending_count;
+    int niov = 0;
+    off_t size;
+    uint64 start = stats_now();
+
+    for (int32 i = 0; i < count; i += 1) {
+        if ((niov > 0) && ((char *) iov[niov - 1].iov_base
+                           + iov[niov - 1].iov_len == (char *) &pending[i])) {
+            iov[niov - 1].iov_len += sizeof (pending[i]);
+        } else {
+            iov[niov].iov_base = &pending[i];
+            iov[niov].iov_len = sizeof (pending[i]);
+            niov += 1;
+        }
+        if (pending[i].length) {
+            iov[niov].iov_base = (void *) pending_payloads[i];
+            iov[niov].iov_len = pending[i].length;
+            niov += 1;
+        }
+    }
+    pending_count = 0;
+
+    if ((journal.fd < 0) || ((size = lseek(journal.fd, 0, SEEK_END)) < 0)) {
+        free(iov);
+        return false;
+    }
+    /* replay stops at a torn record, and would drop every later one */
+    if (!util_writev_all(journal.fd, iov, niov)) {
+        error("Error writing to %s: %s\n", journal.name, strerror(errno));
+        if ((ftruncate(journal.fd, size) < 0)
+            || (lseek(journal.fd, size, SEEK_SET) < 0)) {
+            error("Error truncating %s: %s\n", journal.name, strerror(errno));
+        }
+        free(iov);
+        return false;
+    }
+    free(iov);
+    stats_record(STATS_JOURNAL, start);
+
+    journal_records += count;
+    journal_unsynced = true;
+    return true;
+}
+
+/* Sync the images and records written since the last sync, images first
+ * so that no synced record points at an image that is not. Called with
+ * lock held, which the writer thread lets go of meanwhile, so that
+ * changes keep coming and get synced together the next time. */
+void
+history_journal_sync(void) {
+    DEBUG_PRINT("void");
+    int *images = unsynced_images;
+    int32 nimages = unsynced_images_count;
+    int fd = journal.fd;
+    uint64 start = stats_now();
+
+    unsynced_images = NULL;
+    unsynced_images_count = unsynced_images_size = 0;
+    journal_unsynced = false;
+    syncing = true;
+    if (writer_running)
+        stats_unlock();
+
+    history_sync_images(images, nimages);
+    if ((fd >= 0) && (fdatasync(fd) < 0))
+        error("Error syncing history journal: %s\n", strerror(errno));
+
+    if (writer_running)
+        stats_lock();
+    syncing = false;
+    if (writer_running)
+        cnd_broadcast(&save_done);
+    stats_record(STATS_SYNC, start);
+    return;
+}
+
+/* Images are linked unsynced by history_save_image. This syncs and
+ * closes them, and needs no lock. */
+void
+history_sync_images(int *images, const int32 count) {
+    DEBUG_PRINT("%p, %d", (void *) images, count);
+    for (int32 i = 0; i < count; i += 1) {
+        if (fdatasync(images[i]) < 0)
+            error("Error syncing image: %s\n", strerror(errno));
+        close(images[i]);
+    }
+    free(images);
+    return;
+}
+
+uint64
+history_journal_checksum(JournalRecord *record, const char *payload) {
+    uint64 header[2];
+    memcpy(header, record, sizeof (header));
+    return util_hash(header, sizeof (header))
+           ^ util_hash(payload, record->length);
+}
+
+/* Trailing newlines are stripped from text before it is stored, so they
+ * are not part of its hash either. Raw clipboard data can then be
+ * looked up as text before it is classified. Images are hashed as they
+ * are, their bytes can end in anything. */
+uint64
+history_hash(const char *content, int length, const int32 kind) {
+    if (kind == CLIPBOARD_IMAGE)
+        return util_hash(content, (usize) length);
+    while ((length > 0) && (content[length - 1] == '\n'))
+        length -= 1;
+    return util_hash(content, (usize) length);
+}
+
+uint64
+history_hash_file(const char *path) {
+    DEBUG_PRINT("%s", path);
+    struct stat image_stat;
+    uint64 hash = 0;
+    char *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return 0;
+    if ((fstat(fd, &image_stat) < 0) || (image_stat.st_size <= 0)) {
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(NULL, (usize) image_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+        hash = history_hash(map, (int) image_stat.st_size, CLIPBOARD_IMAGE);
+        munmap(map, (usize) image_stat.st_size);
+    }
+    close(fd);
+    return hash;
+}
+
+/* Open addressing with linear probing over slot numbers. Text is only
+ * compared with text entries and images with image entries, since they
+ * are hashed differently. */
+int32
+history_repeated_index(const uint64 hash, const char *content, int length,
+                       const int32 kind) {
+    DEBUG_PRINT("%lu, %s, %d, %d", hash, content, length, kind);
+    usize mask = index_size - 1;
+
+    while ((length > 0) && (content[length - 1] == '\n'))
+        length -= 1;
+
+    for (usize i = hash & mask; hash_index[i] >= 0; i = (i + 1) & mask) {
+        Entry *e = history_at(hash_index[i]);
+        if (e->hash != hash)
+            continue;
+        if ((kind == CLIPBOARD_IMAGE) != (e->image_path != NULL))
+            continue;
+        /* image entries only keep the path, trust the hash */
+        if (e->image_path)
+            return hash_index[i];
+        if ((e->content_length == length)
+            && !memcmp(e->content, content, (usize) length)) {
+            return hash_index[i];
+        }
+    }
+    return -1;
+}
+
+void
+history_index_insert(const int32 slot) {
+    usize mask;
+    usize i;
+
+    if ((usize) (lastindex + 2)*2 > index_size)
+        history_index_resize(index_size*2);
+    mask = index_size - 1;
+    i = history_at(slot)->hash & mask;
+
+    while (hash_index[i] >= 0)
+        i = (i + 1) & mask;
+    hash_index[i] = slot;
+    return;
+}
+
+/* Backward shift deletion, so that probing never needs tombstones. */
+void
+history_index_delete(const int32 slot) {
+    usize mask = index_size - 1;
+    usize i = history_at(slot)->hash & mask;
+
+    while (hash_index[i] != slot) {
+        if (hash_index[i] < 0)
+            return;
+        i = (i + 1) & mask;
+    }
+
+    for (usize j = (i + 1) & mask; hash_index[j] >= 0; j = (j + 1) & mask) {
+        usize home = history_at(hash_index[j])->hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            hash_index[i] = hash_index[j];
+            i = j;
+        }
+    }
+    hash_index[i] = -1;
+    return;
+}
+
+int32
+history_find_hash(const uint64 hash) {
+    DEBUG_PRINT("%lu", hash);
+    usize mask = index_size - 1;
+
+    for (usize i = hash & mask; hash_index[i] >= 0; i = (i + 1) & mask) {
+        if (history_at(hash_index[i])->hash == hash)
+            return hash_index[i];
+    }
+    return -1;
+}
+
+void
+history_index_resize(const usize size) {
+    DEBUG_PRINT("%zu", size);
+    int32 count = lastindex;
+
+    free(hash_index);
+    hash_index = util_malloc(size*sizeof (*hash_index));
+    index_size = size;
+    memset(hash_index, -1, size*sizeof (*hash_index));
+
+    /* history_index_insert checks the load with lastindex */
+    lastindex = -1;
+    for (int32 slot = oldest; slot >= 0; slot = history_at(slot)->newer)
+        history_index_insert(slot);
+    lastindex = count;
+    return;
+}
+
+void
+history_store_init(void) {
+    DEBUG_PRINT("void");
+    char *CLIPSIM_HISTORY_SIZE;
+    char *CLIPSIM_COMPRESSION;
+
+    if ((CLIPSIM_HISTORY_SIZE = getenv("CLIPSIM_HISTORY_SIZE"))) {
+        int32 size;
+        if ((util_string_int32(&size, CLIPSIM_HISTORY_SIZE) < 0)
+            || (size < 2) || (size > HISTORY_MAX_SIZE)) {
+            error("Invalid CLIPSIM_HISTORY_SIZE: %s. Using %d.\n",
+                  CLIPSIM_HISTORY_SIZE, HISTORY_BUFFER_SIZE);
+        } else {
+            capacity = size;
+        }
+    }
+    if ((CLIPSIM_COMPRESSION = getenv("CLIPSIM_COMPRESSION"))) {
+        int32 level;
+        if ((util_string_int32(&level, CLIPSIM_COMPRESSION) < 0)
+            || (level < 0) || (level > Z_BEST_COMPRESSION)) {
+            error("Invalid CLIPSIM_COMPRESSION: %s. Not compressing.\n",
+                  CLIPSIM_COMPRESSION);
+            level = 0;
+        }
+        compression = level;
+    }
+
+    free_slot = -1;
+    oldest = newest = -1;
+    lastindex = -1;
+    history_index_resize(INDEX_MIN_SIZE);
+    history_renumber();
+    return;
+}
+
+Entry *
+history_at(const int32 slot) {
+    return &pages[slot >> PAGE_SHIFT][slot & (PAGE_SIZE - 1)];
+}
+
+int32
+history_alloc_slot(void) {
+    int32 slot;
+
+    if (free_slot >= 0) {
+        slot = free_slot;
+        free_slot = history_at(slot)->newer;
+        return slot;
+    }
+    if (slots_used >= capacity) {
+        history_evict();
+        return history_alloc_slot();
+    }
+
+    if ((slots_used >> PAGE_SHIFT) >= npages) {
+        pages = util_realloc(pages, (usize) (npages + 1)*sizeof (*pages));
+        pages[npages] = util_calloc(PAGE_SIZE, sizeof (**pages));
+        npages += 1;
+    }
+    slot = slots_used;
+    slots_used += 1;
+    return slot;
+}
+
+/* Translate a client id, negative ones counting from the newest entry. */
+int32
+history_slot(int32 id) {
+    DEBUG_PRINT("%d", id);
+
+    if (id < 0)
+        id = lastindex + id + 1;
+    if ((id < 0) || (id > lastindex))
+        return -1;
+
+    if (id == lastindex)
+        return newest;
+    return sequence_slot[history_fenwick_select(id)];
+}
+
+void
+history_fenwick_add(int32 sequence, const int32 delta) {
+    for (sequence += 1; sequence <= sequence_size; sequence += sequence & -sequence)
+        fenwick[sequence - 1] += delta;
+    return;
+}
+
+/* Sequence number of the live entry with id rank. */
+int32
+history_fenwick_select(int32 rank) {
+    int32 position = 0;
+
+    for (int32 step = sequence_size; step > 0; step >>= 1) {
+        int32 next = position + step;
+        if ((next <= sequence_size) && (fenwick[next - 1] <= rank)) {
+            position = next;
+            rank -= fenwick[next - 1];
+        }
+    }
+    return position;
+}
+
+/* Number of live entries with a sequence number lower than sequence. */
+int32
+history_fenwick_rank(int32 sequence) {
+    int32 rank = 0;
+
+    for (; sequence > 0; sequence -= sequence & -sequence)
+        rank += fenwick[sequence - 1];
+    return rank;
+}
+
+/* Give live entries the sequence numbers 0..n-1 again, leaving as many
+ * free numbers as there are entries. */
+void
+history_renumber(void) {
+    DEBUG_PRINT("void");
+    int32 size = SEQUENCE_MIN_SIZE;
+    int32 sequence = 0;
+
+    while (size < (lastindex + 1)*2)
+        size *= 2;
+    if (size != sequence_size) {
+        free(fenwick);
+        free(sequence_slot);
+        fenwick = util_malloc((usize) size*sizeof (*fenwick));
+        sequence_slot = util_malloc((usize) size*sizeof (*sequence_slot));
+        sequence_size = size;
+    }
+    memset(fenwick, 0, (usize) size*sizeof (*fenwick));
+    if (view_npages > 0) {
+        history_view_drop(view_pages, view_npages);
+        memset(view_pages, 0, (usize) view_npages*sizeof (*view_pages));
+    }
+
+    for (int32 slot = oldest; slot >= 0; slot = history_at(slot)->newer) {
+        history_at(slot)->sequence = sequence;
+        sequence_slot[sequence] = slot;
+        fenwick[sequence] = 1;
+        history_view_set(history_at(slot));
+        sequence += 1;
+    }
+    for (int32 i = 1; i <= size; i += 1) {
+        int32 parent = i + (i & -i);
+        if (parent <= size)
+            fenwick[parent - 1] += fenwick[i - 1];
+    }
+    next_sequence = sequence;
+    return;
+}
+
+bool
+history_journal_full(void) {
+    return journal_records >= MAX(JOURNAL_MIN_RECORDS, (lastindex + 1)*2);
+}
+
+void
+history_unlink(const int32 slot) {
+    Entry *e = history_at(slot);
+
+    history_view_stale();
+    if (e->older >= 0)
+        history_at(e->older)->newer = e->newer;
+    else
+        oldest = e->newer;
+    if (e->newer >= 0)
+        history_at(e->newer)->older = e->older;
+    else
+        newest = e->older;
+
+    history_view_clear(e->sequence);
+    history_fenwick_add(e->sequence, -1);
+    lastindex -= 1;
+    return;
+}
+
+void
+history_link_newest(const int32 slot) {
+    Entry *e = history_at(slot);
+
+    history_view_stale();
+    e->older = newest;
+    e->newer = -1;
+    if (newest >= 0)
+        history_at(newest)->newer = slot;
+    else
+        oldest = slot;
+    newest = slot;
+
+    lastindex += 1;
+    history_prefixes_grow(lastindex + 1);
+
+    if (next_sequence >= sequence_size) {
+        history_renumber();
+        return;
+    }
+    e->sequence = next_sequence;
+    sequence_slot[next_sequence] = slot;
+    history_view_set(e);
+    history_fenwick_add(next_sequence, 1);
+    next_sequence += 1;
+    return;
+}
+
+/* Write the prefixes of ids below count that are not there yet. Pages
+ * of them are kept until the daemon exits, views point into them. */
+void
+history_prefixes_grow(const int32 count) {
+    while ((prefix_pages << PAGE_SHIFT) < count) {
+        char *page = util_malloc((usize) PAGE_SIZE*LISTING_ID_SIZE);
+
+        for (int32 i = 0; i < PAGE_SIZE; i += 1) {
+            int32 id = (prefix_pages << PAGE_SHIFT) + i;
+            snprintf(page + (usize) i*LISTING_ID_SIZE, LISTING_ID_SIZE,
+                     "%.*d ", PRINT_DIGITS, id);
+        }
+        prefixes[prefix_pages] = page;
+        prefix_pages += 1;
+    }
+    return;
+}
+
+/* Drop the oldest entry to make room for a new one. */
+void
+history_evict(void) {
+    DEBUG_PRINT("void");
+    history_journal_record(JOURNAL_REMOVE, 0, history_at(oldest)->hash, NULL, 0);
+    history_delete(oldest);
+    return;
+}
+
+Entry *
+history_entry(const int32 id) {
+    int32 slot = history_slot(id);
+    return slot >= 0 ? history_at(slot) : NULL;
+}
+
+int32
+history_entry_id(const Entry *e) {
+    return history_fenwick_rank(e->sequence);
+}
+
+Entry *
+history_newest(void) {
+    return newest >= 0 ? history_at(newest) : NULL;
+}
+
+Entry *
+history_older(const Entry *e) {
+    return e->older >= 0 ? history_at(e->older) : NULL;
+}
+
+/* Takes ownership of content, which must already be classified and
+ * come from util_slab_alloc(length + 1). */
+void
+history_new_entry(char *content, const int length,
+                  const int32 kind, const uint64 hash) {
+    DEBUG_PRINT("%s, %d, %d, %lu", content, length, kind, hash);
+    int32 slot;
+    Entry *e;
+
+    slot = history_alloc_slot();
+    e = history_at(slot);
+
+    e->content = content;
+    e->content_length = length;
+    e->hash = hash;
+
+    if (kind == CLIPBOARD_IMAGE) {
         e->trimmed = e->content;
         e->trimmed_length = e->content_length;
         e->image_path = e->content;
-        break;
-    default:
-        break;
+    } else {
+        uint64 start = stats_now();
+        content_trim_spaces(&(e->trimmed), &(e->trimmed_length), 
+                            e->content, e->content_length);
+        stats_record(STATS_TRIM, start);
+        e->image_path = NULL;
     }
+    content_bytes += (usize) e->content_length + 1;
+    if (e->trimmed != e->content)
+        content_bytes += (usize) e->trimmed_length + 1;
 
-    if (lastindex + 1 >= HISTORY_BUFFER_SIZE) {
-        history_clean();
-        history_save();
+    history_link_newest(slot);
+    history_index_insert(slot);
+    trigram_add(e);
+    return;
+}
+
+/* Images are stored once, named after the hash of their bytes, so
+ * copying the same image again leads to the same file. They only get
+ * their name once complete, and are synced with the journal record that
+ * points at them, see history_journal_sync. */
+bool
+history_save_image(char **content, int *length, const uint64 hash) {
+    DEBUG_PRINT("%p, %d, %lu", (void *) content, *length, hash);
+    File image = { .file = NULL, .fd = -1 };
+    char buffer[PATH_MAX];
+    int n;
+
+    /* saved next to the history so that the journal can refer to it */
+    n = snprintf(buffer, sizeof (buffer), "%s/clipsim/%016lx.png",
+                                          XDG_CACHE_HOME, hash);
+    if ((n < 0) || (n >= (int) sizeof (buffer)))
+        util_die_notify("Error printing image path.\n");
+
+    image.name = buffer;
+    if (util_create_open(&image) < 0)
+        return false;
+    if (!util_write_all(image.fd, *content, (usize) *length)) {
+        error("Error writing image to %s: %s\n", buffer, strerror(errno));
+        util_create_abort(&image);
+        return false;
+    }
+    if (!util_create_link(&image)) {
+        util_create_abort(&image);
+        return false;
+    }
+
+    /* a burst of images must not keep too many files open */
+    if (unsynced_images_count >= UNSYNCED_IMAGES_MAX) {
+        history_sync_images(unsynced_images, unsynced_images_count);
+        unsynced_images = NULL;
+        unsynced_images_count = unsynced_images_size = 0;
+    }
+    if (unsynced_images_count >= unsynced_images_size) {
+        unsynced_images_size = MAX(unsynced_images_size*2, 4);
+        unsynced_images = util_realloc(unsynced_images,
+                                       (usize) unsynced_images_size
+                                       *sizeof (*unsynced_images));
+    }
+    unsynced_images[unsynced_images_count++] = image.fd;
+
+    *length = n;
+    *content = util_realloc(*content, (usize) *length + 1);
+    memcpy(*content, buffer, (usize) *length + 1);
+    return true;
+}
+
+/* Called without the lock, which is only taken to look content up and
+ * to insert it: a copy already in history is moved to the top before it
+ * is classified, and classification runs with the lock released. kind
+ * is what the clipboard owner said content is. */
+void
+history_append(char *content, int length, const int32 kind) {
+    DEBUG_PRINT("%s, %d, %d", content, length, kind);
+    int32 checked;
+    uint64 hash;
+    uint64 start;
+    bool repeated;
+
+    if (!content) {
+        error("Error getting data from clipboard. Skipping entry...\n");
+        stats_count(STATS_REJECTED, 1);
+        return;
+    }
+
+    hash = history_hash(content, length, kind);
+    stats_lock();
+    repeated = history_dedup(content, length, hash, kind);
+    stats_unlock();
+    if (repeated)
+        return;
+
+    start = stats_now();
+    checked = content_check_content((uchar *) content, length);
+    stats_record(STATS_CLASSIFY, start);
+
+    /* only this thread adds entries, so content is still not in history
+     * unless it turned out to be of another kind */
+    stats_lock();
+    if (checked != kind) {
+        hash = history_hash(content, length, checked);
+        if (history_dedup(content, length, hash, checked)) {
+            stats_unlock();
+            return;
+        }
+    }
+    history_insert(content, length, checked, hash);
+    stats_unlock();
+    return;
+}
+
+/* A copy of some entry only moves it to the top. Returns whether content
+ * was one, in which case it is freed. */
+bool
+history_dedup(char *content, const int length,
+              const uint64 hash, const int32 kind) {
+    DEBUG_PRINT("%s, %d, %lu, %d", content, length, hash, kind);
+    int32 oldindex;
+    uint64 start = stats_now();
+
+    oldindex = history_repeated_index(hash, content, length, kind);
+    stats_record(STATS_DEDUP, start);
+    if (oldindex < 0)
+        return false;
+
+    error("Entry is equal to previous entry. Reordering...\n");
+    stats_count(STATS_DUPLICATES, 1);
+    if (oldindex != newest) {
+        history_reorder(oldindex);
+        history_journal_record(JOURNAL_REORDER, 0, hash, NULL, 0);
+        history_compact();
+    }
+    free(content);
+    return true;
+}
+
+void
+history_insert(char *content, int length,
+               const int32 kind, const uint64 hash) {
+    DEBUG_PRINT("%s, %d, %d, %lu", content, length, kind, hash);
+    switch (kind) {
+    case CLIPBOARD_TEXT:
+        content_remove_newline(content, &length);
+        break;
+    case CLIPBOARD_IMAGE:
+        if (!history_save_image(&content, &length, hash)) {
+            stats_count(STATS_REJECTED, 1);
+            free(content);
+            return;
+        }
+        break;
+    default:
+        stats_count(STATS_REJECTED, 1);
+        free(content);
+        return;
     }
 
+    content = util_slab_move(content, (usize) length + 1);
+    history_new_entry(content, length, kind, hash);
+    stats_count(STATS_ENTRIES, 1);
+    stats_count(STATS_BYTES, (uint64) length);
+    history_journal_record(JOURNAL_APPEND, (uint8) kind, hash,
+                           content, (uint32) length);
+    history_compact();
     return;
 }
 
 void
 history_recover(int32 id) {
     DEBUG_PRINT("%d", id);
-    pid_t child;
-    int fd[2];
-    Entry *e;
-    bool istext;
 
     if (lastindex < 0) {
         error("Clipboard history empty. Start copying text.\n");
@@ -374,91 +2198,129 @@ history_recover(int32 id) {
     }
     if (id < 0)
         id = lastindex + id + 1;
-    if (id > lastindex) {
+    if ((id < 0) || (id > lastindex)) {
         error("Invalid index for recovery: %d\n", id);
-        recovered = true;
         return;
     }
+    history_recover_list(&id, 1);
+    return;
+}
 
-    e = &entries[id];
-    istext = (e->image_path == NULL);
-    if (istext) {
-        if (pipe(fd))
-            util_die_notify("Error creating pipe: %s\n", strerror(errno));
-    }
+/* Move the entries to the top in the order given, the last one owning
+ * the clipboard, with a single compaction. ids are distinct and valid,
+ * and refer to the history as it is when called. */
+void
+history_recover_list(const int32 *ids, const int32 count) {
+    DEBUG_PRINT("%p, %d", (void *) ids, count);
+    int32 *slots = util_malloc((usize) MAX(count, 1)*sizeof (*slots));
+
+    for (int32 i = 0; i < count; i += 1)
+        slots[i] = history_slot(ids[i]);
+    history_raise(slots, count);
+    free(slots);
+    history_compact();
+    return;
+}
 
-    switch ((child = fork())) {
-    case 0:
-        if (istext) {
-            close(fd[1]);
-            dup2(fd[0], STDIN_FILENO);
-            close(fd[0]);
-            execlp("/usr/bin/xclip", "xclip", "-selection", "clipboard", NULL);
-        } else {
-            execlp("/usr/bin/xclip", "xclip", "-selection", "clipboard",
-                   "-target", "image/png", e->image_path, NULL);
-        }
-        util_die_notify("Error in exec(): %s", strerror(errno));
-    case -1:
-        util_die_notify("Error in fork(): %s", strerror(errno));
-    default:
-        if (istext && (close(fd[0]) < 0))
-            util_die_notify("Error closing pipe 0: %s\n", strerror(errno));
-    }
+void
+history_raise(const int32 *slots, const int32 count) {
+    DEBUG_PRINT("%p, %d", (void *) slots, count);
+    Entry *e;
 
-    if (istext) {
-        dprintf(fd[1], "%s", e->content);
-        if (close(fd[1]) < 0) {
-            util_die_notify("Error closing pipe 1: %s\n", strerror(errno));
-        }
+    if (count <= 0)
+        return;
+    for (int32 i = 0; i < count; i += 1) {
+        if (slots[i] == newest)
+            continue;
+        history_reorder(slots[i]);
+        history_journal_record(JOURNAL_REORDER, 0,
+                               history_at(slots[i])->hash, NULL, 0);
     }
-    if (wait(NULL) < 0)
-        util_die_notify("Error waiting for fork: %s\n", strerror(errno));
-
-    if (id != lastindex)
-        history_reorder(id);
 
-    recovered = true;
+    e = history_at(newest);
+    if (e->image_path)
+        clipboard_own(e->image_path, (usize) e->content_length, true);
+    else
+        clipboard_own(e->content, (usize) e->content_length, false);
     return;
 }
 
 void
 history_remove(int32 id) {
     DEBUG_PRINT("%d", id);
+
     if (lastindex <= 0)
         return;
 
-    if (id < 0) {
+    if (id < 0)
         id = lastindex + id + 1;
-    } else if (id == lastindex) {
-        history_recover(-2);
-        history_remove(-2);
-        return;
-    }
-    if (id > lastindex) {
+    if ((id < 0) || (id > lastindex)) {
         error("Invalid index %d for deletion.\n", id);
         return;
     }
+    history_remove_list(&id, 1);
+    return;
+}
 
-    history_free_entry(&entries[id]);
+/* Remove the entries, with a single compaction. ids are distinct and
+ * valid, highest first, and refer to the history as it is when called.
+ * The newest entry is the one in the clipboard, so if it goes the newest
+ * one left takes its place, and the history is never left empty. Only
+ * the listed ids are resolved, before anything moves. */
+void
+history_remove_list(const int32 *ids, const int32 count) {
+    DEBUG_PRINT("%p, %d", (void *) ids, count);
+    int32 *slots = util_malloc((usize) MAX(count, 1)*sizeof (*slots));
+    int32 nslots = 0;
+    int32 keep = lastindex;
+
+    /* the newest entry not listed, ids being highest first */
+    for (int32 i = 0; (i < count) && (ids[i] == keep); i += 1)
+        keep -= 1;
+    if (keep < 0)
+        keep = lastindex;
+
+    for (int32 i = 0; i < count; i += 1) {
+        if (ids[i] != keep)
+            slots[nslots++] = history_slot(ids[i]);
+    }
 
-    if (id < lastindex) {
-        memmove(&entries[id], &(entries[id + 1]),
-                (usize) (lastindex - id)*sizeof (*entries));
-        memset(&entries[lastindex], 0, sizeof (*entries));
+    if ((nslots > 0) && (keep != lastindex)) {
+        int32 slot = history_slot(keep);
+        history_raise(&slot, 1);
     }
-    lastindex -= 1;
 
+    for (int32 i = 0; i < nslots; i += 1) {
+        history_journal_record(JOURNAL_REMOVE, 0,
+                               history_at(slots[i])->hash, NULL, 0);
+        history_delete(slots[i]);
+    }
+    free(slots);
+    history_compact();
+    return;
+}
+
+void
+history_delete(const int32 slot) {
+    DEBUG_PRINT("%d", slot);
+    Entry *e = history_at(slot);
+
+    history_index_delete(slot);
+    history_unlink(slot);
+    trigram_remove(e);
+    history_free_entry(e);
+
+    memset(e, 0, sizeof (*e));
+    e->newer = free_slot;
+    free_slot = slot;
     return;
 }
 
 void
-history_reorder(const int32 oldindex) {
-    DEBUG_PRINT("%d", oldindex);
-    Entry aux = entries[oldindex];
-    memmove(&entries[oldindex], &entries[oldindex + 1],
-            (usize) (lastindex - oldindex)*sizeof (*entries));
-    memmove(&entries[lastindex], &aux, sizeof (*entries));
+history_reorder(const int32 slot) {
+    DEBUG_PRINT("%d", slot);
+    history_unlink(slot);
+    history_link_newest(slot);
     return;
 }
 
@@ -466,29 +2328,24 @@ void
 history_free_entry(const Entry *e) {
     DEBUG_PRINT("{\n    %s,\n    %d,\n    %s,\n    %d\n}",
                 e->content, e->content_length, e->trimmed, e->trimmed_length);
-    length_counts[e->content_length] -= 1;
+    content_bytes -= (usize) e->content_length + 1;
+    if (e->trimmed != e->content)
+        content_bytes -= (usize) e->trimmed_length + 1;
 
     /* image_path does not have to be freed
-       because e->content is the same pointer */ 
+       because e->content is the same pointer, and a view can still
+       serve it, so its file goes with it */ 
+    if (views_oldest) {
+        if (e->trimmed != e->content)
+            history_retire(e->trimmed, (usize) e->trimmed_length + 1, NULL);
+        history_retire(e->content, (usize) e->content_length + 1,
+                       e->image_path ? e : NULL);
+        return;
+    }
     if (e->image_path)
         unlink(e->image_path);
-    free(e->content);
-
     if (e->trimmed != e->content)
-        free(e->trimmed);
-    return;
-}
-
-void
-history_clean(void) {
-    DEBUG_PRINT("void");
-    for (int i = 0; i <= HISTORY_KEEP_SIZE - 1; i += 1)
-        history_free_entry(&entries[i]);
-
-    memcpy(&entries[0], &entries[HISTORY_KEEP_SIZE],
-           HISTORY_KEEP_SIZE * sizeof (*entries));
-    memset(&entries[HISTORY_KEEP_SIZE], 0,
-           HISTORY_KEEP_SIZE * sizeof (*entries));
-    lastindex = HISTORY_KEEP_SIZE - 1;
+        util_slab_free(e->trimmed, (usize) e->trimmed_length + 1);
+    util_slab_free(e->content, (usize) e->content_length + 1);
     return;
 }
@@ -15,352 +15,1276 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
 #include "clipsim.h"
 
+#define IPC_MAX_EVENTS 16
+#define IPC_VERSION 1
+#define IPC_TIMEOUT 2
+#define IPC_IDLE_TIMEOUT 60
+#define IPC_SWEEP_MS 1000
+#define IPC_LIST_MAX 4096
+
+/* Every message, both ways, is a Frame followed by length bytes of
+ * payload. A request has a COMMAND_* in type, its number in argument and
+ * the query, without NUL, as payload. For copy, remove and info a
+ * payload is a list of entries, like "3-17,22", taking the place of the
+ * number, of up to IPC_LIST_MAX bytes with the NUL, while queries take up
+ * to SEARCH_QUERY_MAX. Clients choose the ids and may send
+ * several requests without waiting: each reply carries the id of its
+ * request, they come in the order the requests were sent, and each is a
+ * FRAME_DATA with what used to be the whole output of the command
+ * followed by a FRAME_END with an exit status in argument. */
+typedef struct Frame {
+    uint64 length;
+    uint32 id;
+    uint16 version;
+    uint16 type;
+    int32 argument;
+    uint32 unused;
+} Frame;
+
+enum {
+    FRAME_DATA = 0x100,
+    FRAME_END,
+};
+
+/* A reply waiting to be sent, from iov[0] to iov[count - 1], iov moving
+ * along vectors as it goes. The first and last vectors are its frames,
+ * the ones in between point into the view it holds or into text, which
+ * it owns. */
+typedef struct Reply {
+    struct iovec *vectors;
+    struct iovec *iov;
+    int count;
+    int unused;
+    Frame frames[2];
+    HistoryView *view;
+    char *text;
+    usize text_length;
+    struct Reply *next;
+} Reply;
+
+/* Clients are served from a single thread, reading and writing without
+ * blocking. Input holds what came after the last request handled. A
+ * client with a job waits for it, see Job. */
+typedef struct Client {
+    int fd;
+    uint32 events;
+    uint64 deadline;
+    Reply *replies;
+    Reply *last;
+    struct Job *job;
+    struct Client *next;
+    bool closing;
+    usize input_length;
+    char input[BUFSIZ];
+} Client;
+
+/* A request answered off the listening thread: a --save, which the
+ * history writer does, or a search, which runs on its own thread. Either
+ * way done is written when it is over, and the reply is queued by the
+ * listening thread, which meanwhile reads nothing more from the client
+ * and does not time it out. */
+typedef struct Job {
+    Client *client;
+    Reply *reply;
+    HistoryView *view;
+    uint64 ticket;
+    uint32 id;
+    int32 status;
+    int32 k;
+    int32 unused;
+    char query[SEARCH_QUERY_MAX];
+    struct Job *next;
+} Job;
+
 static const char *tmp = "/tmp/clipsim";
-static File command_fifo = { .file = NULL, .fd = -1,
-                             .name = "/tmp/clipsim/command.fifo" };
-static File passid_fifo  = { .file = NULL, .fd = -1,
-                             .name = "/tmp/clipsim/passid.fifo" };
-static File content_fifo = { .file = NULL, .fd = -1,
-                             .name = "/tmp/clipsim/content.fifo" };
-
-static void ipc_daemon_history_save(void);
-static void ipc_client_check_save(void);
-static void ipc_daemon_pipe_entries(void);
-static void ipc_daemon_pipe_id(const int32);
-static void ipc_client_print_entries(void);
-static int32 ipc_daemon_get_id(void);
-static void ipc_client_ask_id(const int32);
-static void ipc_make_fifos(void);
-static void ipc_clean_fifo(const char *);
-static void ipc_create_fifo(const char *);
+static const char *socket_name = "/tmp/clipsim/clipsim.sock";
+static int epoll_fd = -1;
+static Client *clients = NULL;
+static int done = -1;
+static mtx_t jobs_lock;
+static Job *jobs_done = NULL;
+static Job *saves = NULL;
+
+static void ipc_daemon_accept(int);
+static bool ipc_daemon_client(Client *, const uint32);
+static bool ipc_daemon_request(Client *);
+static void ipc_daemon_handle(Client *, const Frame *, const char *);
+static isize ipc_daemon_flush(Client *);
+static void ipc_daemon_drop(Client *);
+static void ipc_daemon_sweep(void);
+static Job *ipc_job_new(Client *, const Frame *);
+static void ipc_job_done(Job *);
+static void ipc_daemon_jobs(void);
+static HistoryView *ipc_daemon_view(void);
+static void ipc_daemon_release(HistoryView *);
+static Reply *ipc_reply_new(const int);
+static FILE *ipc_reply_open(Reply *);
+static void ipc_reply_close(Reply *, FILE *, const int);
+static void ipc_reply_queue(Client *, Reply *, const uint32, const int32);
+static void ipc_reply_free(Reply *);
+static void ipc_daemon_message(Client *, const Frame *, const int32,
+                               const char *, ...);
+static void ipc_daemon_history_save(Client *, const Frame *);
+static void ipc_daemon_pipe_entries(Client *, const Frame *);
+static void ipc_daemon_pipe_id(Client *, const Frame *);
+static void ipc_daemon_pipe_list(Client *, const Frame *, const char *);
+static void ipc_daemon_change(Client *, const Frame *, const char *);
+static int32 ipc_daemon_ids(const char *, const int32, int32 **);
+static int32 ipc_daemon_ids_unique(int32 *, const int32);
+static int ipc_compare_keys(const void *, const void *);
+static int ipc_compare_ids_down(const void *, const void *);
+static void ipc_daemon_stats(Client *, const Frame *);
+static void ipc_daemon_search(Client *, const Frame *, const char *);
+static int ipc_search_job(void *);
+static void ipc_daemon_grep(Client *, const Frame *, const char *);
+static bool ipc_client_read(int, void *, usize);
+static int ipc_client_receive(int, const Frame *);
+static void ipc_client_preview(const char *);
+static int ipc_daemon_make_socket(void);
+static bool ipc_epoll_add(int, void *, uint32);
 
 int
-ipc_daemon_listen_fifo(void *unused) {
+ipc_daemon_listen(void *unused) {
     DEBUG_PRINT("");
     (void) unused;
-    char command;
-    struct timespec pause;
-    pause.tv_sec = 0;
-    pause.tv_nsec = PAUSE10MS;
+    struct epoll_event events[IPC_MAX_EVENTS];
+    int listen_fd;
 
     if (mkdir(tmp, 0770) < 0) {
         if (errno != EEXIST)
             util_die_notify("Error creating %s: %s\n", tmp, strerror(errno));
     }
-    ipc_make_fifos();
+    listen_fd = ipc_daemon_make_socket();
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        util_die_notify("Error creating epoll instance: %s\n", strerror(errno));
+    if (!ipc_epoll_add(listen_fd, NULL, EPOLLIN))
+        util_die_notify("Error listening on %s.\n", socket_name);
+
+    if ((done = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        util_die_notify("Error creating eventfd: %s\n", strerror(errno));
+    if (mtx_init(&jobs_lock, mtx_plain) != thrd_success)
+        util_die_notify("Error creating mutex.\n");
+    if (!ipc_epoll_add(done, &done, EPOLLIN))
+        util_die_notify("Error waiting for jobs.\n");
 
     while (true) {
-        isize r;
-        nanosleep(&pause, NULL);
-        if (util_open(&command_fifo, O_RDONLY) < 0)
+        int nevents;
+
+        nevents = epoll_wait(epoll_fd, events, LENGTH(events),
+                             clients ? IPC_SWEEP_MS : -1);
+        if (nevents < 0) {
+            if (errno != EINTR)
+                error("Error waiting for clients: %s\n", strerror(errno));
             continue;
-        mtx_lock(&lock);
+        }
+
+        for (int i = 0; i < nevents; i += 1) {
+            Client *client = events[i].data.ptr;
+
+            if (client == NULL)
+                ipc_daemon_accept(listen_fd);
+            else if ((void *) client == &done)
+                ipc_daemon_jobs();
+            else if (!ipc_daemon_client(client, events[i].events))
+                ipc_daemon_drop(client);
+        }
+        ipc_daemon_sweep();
+    }
+}
 
-        r = read(command_fifo.fd, &command, sizeof (*(&command)));
-        if (r < (isize) sizeof (*(&command))) {
-            error("Error reading command from %s: %s\n",
-                  command_fifo.name, strerror(errno));
-            mtx_unlock(&lock);
+void
+ipc_daemon_accept(int listen_fd) {
+    DEBUG_PRINT("%d", listen_fd);
+    int fd;
+
+    while ((fd = accept4(listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        Client *client = util_calloc(1, sizeof (*client));
+
+        client->fd = fd;
+        client->events = EPOLLIN | EPOLLRDHUP;
+        client->deadline = stats_now() + IPC_IDLE_TIMEOUT*1000000000ull;
+        if (!ipc_epoll_add(fd, client, client->events)) {
+            free(client);
             continue;
         }
+        client->next = clients;
+        clients = client;
+    }
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+        error("Error accepting client: %s\n", strerror(errno));
+    return;
+}
 
-        util_close(&command_fifo);
-        switch (command) {
-        case COMMAND_PRINT:
-            ipc_daemon_pipe_entries();
-            break;
-        case COMMAND_SAVE:
-            ipc_daemon_history_save();
-            break;
-        case COMMAND_COPY:
-            history_recover(ipc_daemon_get_id());
-            break;
-        case COMMAND_REMOVE:
-            history_remove(ipc_daemon_get_id());
+/* Read, handle and answer requests as far as it goes without blocking.
+ * No request is handled while a reply is pending, so replies go in order
+ * and a client that does not read them only holds back itself. Returns
+ * false when the client is done. */
+bool
+ipc_daemon_client(Client *client, const uint32 events) {
+    DEBUG_PRINT("%d, %u", client->fd, events);
+    bool moved = false;
+    uint32 wanted;
+
+    /* a hang up while it waits is seen once the job is done */
+    if (client->job)
+        return true;
+    if (events & EPOLLERR)
+        return false;
+
+    while (true) {
+        isize r;
+
+        if ((r = ipc_daemon_flush(client)) < 0)
+            return false;
+        moved = moved || (r > 0);
+        if (client->replies || client->job)
             break;
-        case COMMAND_INFO:
-            ipc_daemon_pipe_id(ipc_daemon_get_id());
+        if (ipc_daemon_request(client))
+            continue;
+        if (client->closing)
+            return false;
+
+        r = read(client->fd, client->input + client->input_length,
+                 sizeof (client->input) - client->input_length);
+        if (r > 0) {
+            client->input_length += (usize) r;
+            moved = true;
+            continue;
+        }
+        if (r == 0) {
+            if (client->input_length)
+                error("Client left in the middle of a request.\n");
+            client->closing = true;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
             break;
-        default:
-            error("Invalid command received: '%c'\n", command);
+        error("Error reading from client: %s\n", strerror(errno));
+        return false;
+    }
+
+    if (moved) {
+        uint64 timeout = (client->replies || client->input_length)
+                         ? IPC_TIMEOUT : IPC_IDLE_TIMEOUT;
+        client->deadline = stats_now() + timeout*1000000000ull;
+    }
+
+    if (client->job)
+        wanted = EPOLLONESHOT;
+    else
+        wanted = client->replies ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+    if (wanted != client->events) {
+        struct epoll_event event = { .events = wanted, .data.ptr = client };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event) < 0) {
+            error("Error waiting on client: %s\n", strerror(errno));
+            return false;
         }
+        client->events = wanted;
+    }
+    return true;
+}
+
+/* Handle the first request in the input, if it is all there. */
+bool
+ipc_daemon_request(Client *client) {
+    char query[IPC_LIST_MAX];
+    Frame frame;
+    usize size;
 
-        mtx_unlock(&lock);
+    if (client->input_length < sizeof (frame))
+        return false;
+    memcpy(&frame, client->input, sizeof (frame));
+
+    /* nothing after a bad frame can be trusted */
+    if ((frame.version != IPC_VERSION) || (frame.length >= IPC_LIST_MAX)) {
+        error("Invalid request from client: version %u, %lu bytes.\n",
+              frame.version, (ulong) frame.length);
+        ipc_daemon_message(client, &frame, EXIT_FAILURE,
+                           "Invalid request, version %d expected.\n",
+                           IPC_VERSION);
+        client->input_length = 0;
+        client->closing = true;
+        return true;
     }
+
+    size = sizeof (frame) + frame.length;
+    if (client->input_length < size)
+        return false;
+    memcpy(query, client->input + sizeof (frame), frame.length);
+    query[frame.length] = '\0';
+    client->input_length -= size;
+    memmove(client->input, client->input + size, client->input_length);
+
+    ipc_daemon_handle(client, &frame, query);
+    return true;
 }
 
+/* Only the commands that change the history hold the lock while they
+ * run. The others reply from a view of the history, taken with the lock
+ * held for just that, see history_view(). Copy, remove and info take
+ * either the id in argument or a list of them as payload, see
+ * ipc_daemon_ids(). */
 void
-ipc_client_speak_fifo(uint command, int32 id) {
-    DEBUG_PRINT("%u, %d", command, id);
-    isize w;
-    if (util_open(&command_fifo, O_WRONLY | O_NONBLOCK) < 0) {
-        error("Could not open Fifo for sending command to daemon. "
-              "Is `%s daemon` running?\n", "clipsim");
-        exit(EXIT_FAILURE);
-    }
+ipc_daemon_handle(Client *client, const Frame *request, const char *query) {
+    DEBUG_PRINT("%d, %u, %s", client->fd, request->type, query);
+    stats_count(STATS_REQUESTS, 1);
 
-    w = write(command_fifo.fd, &command, sizeof (*(&command)));
-    util_close(&command_fifo);
-    if (w < (isize) sizeof (*(&command))) {
-        error("Error writing command to %s: %s\n",
-              command_fifo.name, strerror(errno));
-        exit(EXIT_FAILURE);
+    if (((request->type == COMMAND_SEARCH) || (request->type == COMMAND_GREP))
+        && (request->length >= SEARCH_QUERY_MAX)) {
+        ipc_daemon_message(client, request, EXIT_FAILURE,
+                           "Query is longer than %d bytes.\n",
+                           SEARCH_QUERY_MAX - 1);
+        return;
     }
 
-    switch (command) {
+    switch (request->type) {
     case COMMAND_PRINT:
-        ipc_client_print_entries();
+        ipc_daemon_pipe_entries(client, request);
         break;
     case COMMAND_SAVE:
-        ipc_client_check_save();
+        ipc_daemon_history_save(client, request);
         break;
     case COMMAND_COPY:
     case COMMAND_REMOVE:
-        ipc_client_ask_id(id);
+        ipc_daemon_change(client, request, query);
         break;
     case COMMAND_INFO:
-        ipc_client_ask_id(id);
-        ipc_client_print_entries();
+        if (query[0])
+            ipc_daemon_pipe_list(client, request, query);
+        else
+            ipc_daemon_pipe_id(client, request);
+        break;
+    case COMMAND_STATS:
+        ipc_daemon_stats(client, request);
+        break;
+    case COMMAND_SEARCH:
+        ipc_daemon_search(client, request, query);
+        break;
+    case COMMAND_GREP:
+        ipc_daemon_grep(client, request, query);
         break;
     default:
-        error("Invalid command: %u\n", command);
-        exit(EXIT_FAILURE);
+        error("Invalid command received: '%u'\n", request->type);
+        ipc_daemon_message(client, request, EXIT_FAILURE,
+                           "Invalid command: %u\n", request->type);
     }
-
     return;
 }
 
-void
-ipc_daemon_history_save(void) {
-    DEBUG_PRINT("");
-    char saved;
-    isize saved_size = sizeof (*(&saved));
-    error("Trying to save history...\n");
-    if (util_open(&content_fifo, O_WRONLY) < 0)
-        return;
+/* Returns how much was sent, or -1 if the client is gone. */
+isize
+ipc_daemon_flush(Client *client) {
+    isize sent = 0;
+
+    while (client->replies) {
+        Reply *reply = client->replies;
 
-    saved = history_save();
+        while (reply->count > 0) {
+            isize w = writev(client->fd, reply->iov, MIN(reply->count, IOV_MAX));
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                    return sent;
+                error("Error writing to client: %s\n", strerror(errno));
+                return -1;
+            }
+            sent += w;
+            while ((reply->count > 0) && ((usize) w >= reply->iov->iov_len)) {
+                w -= (isize) reply->iov->iov_len;
+                reply->iov += 1;
+                reply->count -= 1;
+            }
+            if (reply->count > 0) {
+                reply->iov->iov_base = (char *) reply->iov->iov_base + w;
+                reply->iov->iov_len -= (usize) w;
+            }
+        }
 
-    if (write(content_fifo.fd, &saved, (usize) saved_size) < saved_size) {
-        error("Error sending save result to client.\n");
+        client->replies = reply->next;
+        ipc_reply_free(reply);
     }
+    client->last = NULL;
+    return sent;
+}
+
+void
+ipc_daemon_drop(Client *client) {
+    DEBUG_PRINT("%d", client->fd);
+    Client **link = &clients;
 
-    util_close(&content_fifo);
+    while (*link != client)
+        link = &((*link)->next);
+    *link = client->next;
+
+    close(client->fd);
+    while (client->replies) {
+        Reply *reply = client->replies;
+        client->replies = reply->next;
+        ipc_reply_free(reply);
+    }
+    free(client);
     return;
 }
 
+/* Drop the clients idle for IPC_IDLE_TIMEOUT seconds, and the ones that
+ * leave a request or a reply halfway for IPC_TIMEOUT seconds. */
 void
-ipc_client_check_save(void) {
-    DEBUG_PRINT("");
-    isize r;
-    char saved = 0;
-    error("Trying to save history...\n");
-    if (util_open(&content_fifo, O_RDONLY) < 0)
-        exit(EXIT_FAILURE);
+ipc_daemon_sweep(void) {
+    uint64 now = stats_now();
+    Client *client = clients;
 
-    if ((r = read(content_fifo.fd, &saved, sizeof (*(&saved)))) > 0) {
-        if (saved)
-            error("History saved to disk.\n");
-        else
-            error("Error saving history to disk.\n");
+    while (client) {
+        Client *next = client->next;
+        if ((client->job == NULL) && (now > client->deadline)) {
+            if (client->replies || client->input_length)
+                error("Client timed out.\n");
+            ipc_daemon_drop(client);
+        }
+        client = next;
     }
+    return;
+}
 
-    util_close(&content_fifo);
-    if (!saved)
-        exit(EXIT_FAILURE);
+Job *
+ipc_job_new(Client *client, const Frame *request) {
+    Job *job = util_calloc(1, sizeof (*job));
+
+    job->client = client;
+    job->id = request->id;
+    client->job = job;
+    return job;
+}
+
+/* Called from the thread the job ran on. */
+void
+ipc_job_done(Job *job) {
+    uint64 one = 1;
+
+    mtx_lock(&jobs_lock);
+    job->next = jobs_done;
+    jobs_done = job;
+    mtx_unlock(&jobs_lock);
+
+    if (write(done, &one, sizeof (one)) < 0)
+        error("Error waking client listener: %s\n", strerror(errno));
     return;
 }
 
+/* Queue the replies of the jobs that are done and go on with their
+ * clients. */
 void
-ipc_daemon_pipe_entries(void) {
-    DEBUG_PRINT("");
-    static char buffer[BUFSIZ];
-    int32 lastindex;
+ipc_daemon_jobs(void) {
+    DEBUG_PRINT("void");
+    Job **link = &saves;
+    Job *finished;
+    uint64 count;
 
-    content_fifo.file = fopen(content_fifo.name, "w");
-    setvbuf(content_fifo.file, buffer, _IOFBF, BUFSIZ);
+    (void) read(done, &count, sizeof (count));
 
-    lastindex = history_lastindex();
+    mtx_lock(&jobs_lock);
+    finished = jobs_done;
+    jobs_done = NULL;
+    mtx_unlock(&jobs_lock);
 
-    if (lastindex == -1) {
-        error("Clipboard history empty. Start copying text.\n");
-        dprintf(content_fifo.fd,
-                "000 Clipboard history empty. Start copying text.\n");
-        goto close;
-    }
+    stats_lock();
+    while (*link) {
+        Job *job = *link;
+        int saved;
 
-    for (int32 i = lastindex; i >= 0; i -= 1) {
-        Entry *e = &entries[i];
-        usize size = (usize) e->trimmed_length + 1;
-        fprintf(content_fifo.file, "%.*d ", PRINT_DIGITS, i);
-        if (fwrite(e->trimmed, 1, size, content_fifo.file) < size) {
-            error("Error writing to client fifo.\n");
-            break;
+        if ((saved = history_saved(job->ticket)) < 0) {
+            link = &job->next;
+            continue;
         }
+        *link = job->next;
+        job->status = saved ? EXIT_SUCCESS : EXIT_FAILURE;
+        job->next = finished;
+        finished = job;
     }
-    fflush(content_fifo.file);
+    stats_unlock();
+
+    while (finished) {
+        Job *job = finished;
+        Client *client = job->client;
 
-    close:
-    util_close(&content_fifo);
+        finished = job->next;
+        client->job = NULL;
+        client->deadline = stats_now() + IPC_TIMEOUT*1000000000ull;
+        ipc_reply_queue(client, job->reply, job->id, job->status);
+        free(job);
+        if (!ipc_daemon_client(client, 0))
+            ipc_daemon_drop(client);
+    }
     return;
 }
 
+HistoryView *
+ipc_daemon_view(void) {
+    HistoryView *view;
+
+    stats_lock();
+    view = history_view();
+    stats_unlock();
+    history_view_entries(view);
+    return view;
+}
+
 void
-ipc_daemon_pipe_id(const int32 id) {
-    DEBUG_PRINT("%d", id);
-    Entry *e;
-    int32 lastindex;
-    usize tag_size = sizeof (*(&IMAGE_TAG));
+ipc_daemon_release(HistoryView *view) {
+    stats_lock();
+    history_view_release(view);
+    stats_unlock();
+    return;
+}
+
+/* A reply with room for body iovecs between its frames. */
+Reply *
+ipc_reply_new(const int body) {
+    Reply *reply = util_calloc(1, sizeof (*reply));
+
+    reply->count = body + 2;
+    reply->vectors = util_calloc((usize) reply->count, sizeof (*(reply->vectors)));
+    reply->iov = reply->vectors;
+    reply->view = NULL;
+    reply->text = NULL;
+    reply->next = NULL;
+    return reply;
+}
+
+/* The text of a reply is written with stdio, it can only have one. */
+FILE *
+ipc_reply_open(Reply *reply) {
+    FILE *stream;
 
-    if (util_open(&content_fifo, O_WRONLY) < 0)
+    if ((stream = open_memstream(&reply->text, &reply->text_length)) == NULL)
+        util_die_notify("Error opening memory stream: %s\n", strerror(errno));
+    return stream;
+}
+
+/* Body iovec i gets the text. */
+void
+ipc_reply_close(Reply *reply, FILE *stream, const int i) {
+    if (fclose(stream) != 0)
+        util_die_notify("Error writing to memory stream: %s\n", strerror(errno));
+    reply->iov[i + 1].iov_base = reply->text;
+    reply->iov[i + 1].iov_len = reply->text_length;
+    return;
+}
+
+/* Frame the body of reply and send it after the other replies. */
+void
+ipc_reply_queue(Client *client, Reply *reply,
+                const uint32 id, const int32 status) {
+    usize length = 0;
+
+    for (int i = 1; i < reply->count - 1; i += 1)
+        length += reply->iov[i].iov_len;
+
+    reply->frames[0] = (Frame) {
+        .length = length,
+        .id = id,
+        .version = IPC_VERSION,
+        .type = FRAME_DATA,
+    };
+    reply->frames[1] = (Frame) {
+        .id = id,
+        .version = IPC_VERSION,
+        .type = FRAME_END,
+        .argument = status,
+    };
+    reply->iov[0].iov_base = &reply->frames[0];
+    reply->iov[0].iov_len = length ? sizeof (reply->frames[0]) : 0;
+    reply->iov[reply->count - 1].iov_base = &reply->frames[1];
+    reply->iov[reply->count - 1].iov_len = sizeof (reply->frames[1]);
+
+    if (client->last)
+        client->last->next = reply;
+    else
+        client->replies = reply;
+    client->last = reply;
+    return;
+}
+
+void
+ipc_reply_free(Reply *reply) {
+    if (reply->view)
+        ipc_daemon_release(reply->view);
+    free(reply->text);
+    free(reply->vectors);
+    free(reply);
+    return;
+}
+
+void
+ipc_daemon_message(Client *client, const Frame *request, const int32 status,
+                   const char *format, ...) {
+    Reply *reply = ipc_reply_new(1);
+    FILE *stream = ipc_reply_open(reply);
+    va_list args;
+
+    va_start(args, format);
+    vfprintf(stream, format, args);
+    va_end(args);
+    ipc_reply_close(reply, stream, 0);
+    ipc_reply_queue(client, reply, request->id, status);
+    return;
+}
+
+/* Answered by ipc_daemon_jobs() once the writer is done. */
+void
+ipc_daemon_history_save(Client *client, const Frame *request) {
+    DEBUG_PRINT("%d", client->fd);
+    Job *job = ipc_job_new(client, request);
+    error("Trying to save history...\n");
+
+    job->reply = ipc_reply_new(0);
+    stats_lock();
+    job->ticket = history_save_ask(done);
+    stats_unlock();
+
+    job->next = saves;
+    saves = job;
+    return;
+}
+
+/* The view has the listing ready, so this is usually a single
+ * writev(). */
+void
+ipc_daemon_pipe_entries(Client *client, const Frame *request) {
+    DEBUG_PRINT("%d", client->fd);
+    HistoryView *view = ipc_daemon_view();
+    Reply *reply;
+
+    if (view->count == 0) {
+        ipc_daemon_release(view);
+        error("Clipboard history empty. Start copying text.\n");
+        ipc_daemon_message(client, request, EXIT_SUCCESS,
+                           "000 Clipboard history empty. Start copying text.\n");
         return;
+    }
+
+    reply = ipc_reply_new(2*view->count);
+    memcpy(&reply->iov[1], view->listing,
+           (usize) view->count*2*sizeof (*(view->listing)));
+    reply->view = view;
+    ipc_reply_queue(client, reply, request->id, EXIT_SUCCESS);
+    return;
+}
 
-    lastindex = history_lastindex();
+void
+ipc_daemon_pipe_id(Client *client, const Frame *request) {
+    DEBUG_PRINT("%d, %d", client->fd, request->argument);
+    HistoryView *view = ipc_daemon_view();
+    int32 id = request->argument;
+    const Entry *e;
+    Reply *reply;
 
-    if (lastindex == -1) {
+    if (view->count == 0) {
+        ipc_daemon_release(view);
         error("Clipboard history empty. Start copying text.\n");
-        dprintf(content_fifo.fd,
-                "000 Clipboard history empty. Start copying text.\n");
-        goto close;
+        ipc_daemon_message(client, request, EXIT_SUCCESS,
+                           "000 Clipboard history empty. Start copying text.\n");
+        return;
     }
+    /* negative ids count from the newest entry, like history_entry() */
+    if ((id < -view->count) || (id >= view->count)) {
+        ipc_daemon_release(view);
+        ipc_daemon_message(client, request, EXIT_FAILURE,
+                           "Invalid index: %d\n", id);
+        return;
+    }
+    e = &view->entries[id < 0 ? view->count + id : id];
 
-    e = &entries[id];
+    reply = ipc_reply_new(2);
     if (e->image_path) {
-        isize w = write(content_fifo.fd, &IMAGE_TAG, tag_size);
-        if (w < (isize) tag_size) {
-            dprintf(content_fifo.fd, "Error printing image tag.\n");
-            goto close;
-        }
+        reply->iov[1].iov_base = (char *) &IMAGE_TAG;
+        reply->iov[1].iov_len = sizeof (*(&IMAGE_TAG));
     } else {
-        dprintf(content_fifo.fd,
-                "Lenght: \033[31;1m%d\n\033[0;m", e->content_length);
+        FILE *stream = ipc_reply_open(reply);
+        fprintf(stream, "Length: \033[31;1m%d\n\033[0;m", e->content_length);
+        ipc_reply_close(reply, stream, 0);
     }
-    dprintf(content_fifo.fd, "%s", e->content);
-
-    close:
-    util_close(&content_fifo);
+    reply->iov[2].iov_base = e->content;
+    reply->iov[2].iov_len = strlen(e->content);
+    reply->view = view;
+    ipc_reply_queue(client, reply, request->id, EXIT_SUCCESS);
     return;
 }
 
-
+/* Each entry like --info shows it, preceded by its id and followed by a
+ * NUL. Images are not shown, only their file name. */
 void
-ipc_client_print_entries(void) {
-    DEBUG_PRINT("");
-    static char buffer[BUFSIZ];
-    isize r;
+ipc_daemon_pipe_list(Client *client, const Frame *request, const char *list) {
+    DEBUG_PRINT("%d, %s", client->fd, list);
+    static const char nul = '\0';
+    HistoryView *view = ipc_daemon_view();
+    int32 *ids;
+    usize *offsets;
+    Reply *reply;
+    FILE *stream;
+    int32 count;
 
-    if (util_open(&content_fifo, O_RDONLY) < 0)
+    if ((count = ipc_daemon_ids(list, view->count, &ids)) < 0) {
+        ipc_daemon_release(view);
+        ipc_daemon_message(client, request, EXIT_FAILURE,
+                           "Invalid list of entries: %s\n", list);
         return;
+    }
 
-    r = read(content_fifo.fd, buffer, sizeof (buffer));
-    if (r <= 0) {
-        error("Error reading data from %s: %s\n",
-              content_fifo.name, strerror(errno));
-        util_close(&content_fifo);
-        exit(EXIT_FAILURE);
+    reply = ipc_reply_new(3*count);
+    offsets = util_malloc(((usize) count + 1)*sizeof (*offsets));
+    stream = ipc_reply_open(reply);
+    for (int32 i = 0; i < count; i += 1) {
+        const Entry *e = &view->entries[ids[i]];
+        offsets[i] = (usize) ftell(stream);
+        if (e->image_path) {
+            fprintf(stream, "%.*d Image: ", PRINT_DIGITS, ids[i]);
+        } else {
+            fprintf(stream, "%.*d Length: \033[31;1m%d\n\033[0;m",
+                            PRINT_DIGITS, ids[i], e->content_length);
+        }
     }
-    if (buffer[0] != IMAGE_TAG) {
-        do {
-            fwrite(buffer, 1, (usize) r, stdout);
-        } while ((r = read(content_fifo.fd, buffer, sizeof (buffer))) > 0);
-    } else {
-        int test;
-        char *CLIPSIM_IMAGE_PREVIEW;
-        if (r == 1) {
-            r = read(content_fifo.fd, buffer + 1, sizeof (buffer) - 1);
-            if (r <= 0)
-                util_die_notify("Error reading image name.\n");
+    offsets[count] = (usize) ftell(stream);
+    ipc_reply_close(reply, stream, 0);
+
+    /* the text is only in place once the stream is closed */
+    for (int32 i = 0; i < count; i += 1) {
+        const Entry *e = &view->entries[ids[i]];
+        struct iovec *iov = &reply->iov[1 + 3*i];
+        iov[0].iov_base = reply->text + offsets[i];
+        iov[0].iov_len = offsets[i + 1] - offsets[i];
+        iov[1].iov_base = e->content;
+        iov[1].iov_len = strlen(e->content);
+        iov[2].iov_base = (char *) &nul;
+        iov[2].iov_len = sizeof (nul);
+    }
+    free(offsets);
+    free(ids);
+
+    reply->view = view;
+    ipc_reply_queue(client, reply, request->id, EXIT_SUCCESS);
+    return;
+}
+
+/* Copy or remove, with the list resolved and applied in one go under
+ * the lock, so the ids are the ones the user saw. */
+void
+ipc_daemon_change(Client *client, const Frame *request, const char *list) {
+    DEBUG_PRINT("%d, %u, %s", client->fd, request->type, list);
+    int32 *ids;
+    int32 count;
+
+    if (list[0] == '\0') {
+        int32 id = request->argument;
+
+        stats_lock();
+        count = history_lastindex() + 1;
+        if (id < 0)
+            id += count;
+        if ((id >= 0) && (id < count)) {
+            if (request->type == COMMAND_COPY)
+                history_recover(id);
+            else
+                history_remove(id);
         }
-        util_close(&content_fifo);
-        if ((test = open(buffer + 1, O_RDONLY)) >= 0) {
-            close(test);
+        stats_unlock();
+
+        if (count == 0) {
+            ipc_daemon_message(client, request, EXIT_FAILURE,
+                               "Clipboard history empty. Start copying text.\n");
+        } else if ((id < 0) || (id >= count)) {
+            ipc_daemon_message(client, request, EXIT_FAILURE,
+                               "Invalid index: %d\n", request->argument);
         } else {
-            error("Error opening %s: %s\n", buffer + 1, strerror(errno)); 
-            return;
+            ipc_reply_queue(client, ipc_reply_new(0), request->id, EXIT_SUCCESS);
         }
+        return;
+    }
 
-        CLIPSIM_IMAGE_PREVIEW = getenv("CLIPSIM_IMAGE_PREVIEW");
-        if (CLIPSIM_IMAGE_PREVIEW == NULL)
-            CLIPSIM_IMAGE_PREVIEW = "chafa";
-        if (!strcmp(CLIPSIM_IMAGE_PREVIEW, "stiv_draw"))
-            execlp("stiv_draw", "stiv_draw", buffer + 1, "30", "15", NULL);   
-        else
-            execlp("chafa", "chafa", buffer + 1, "-s", "40x", NULL);
+    stats_lock();
+    if ((count = ipc_daemon_ids(list, history_lastindex() + 1, &ids)) >= 0) {
+        if (request->type == COMMAND_COPY) {
+            history_recover_list(ids, count);
+        } else {
+            qsort(ids, (usize) count, sizeof (*ids), ipc_compare_ids_down);
+            history_remove_list(ids, count);
+        }
+        free(ids);
     }
+    stats_unlock();
 
-    util_close(&content_fifo);
+    if (count < 0) {
+        ipc_daemon_message(client, request, EXIT_FAILURE,
+                           "Invalid list of entries: %s\n", list);
+        return;
+    }
+    ipc_reply_queue(client, ipc_reply_new(0), request->id, EXIT_SUCCESS);
     return;
 }
 
+/* Put in *ids the entries of list, like "3-17,22", in the order given
+ * and each once. Ranges may go down, and negative ids count from the
+ * newest entry, so "-3--1" are the newest three. Returns how many, or -1
+ * if some id is not one of the count entries, in which case there is
+ * nothing to free. Only the listed ids are looked at, so a short list
+ * costs the same however long the history is. */
 int32
-ipc_daemon_get_id(void) {
-    DEBUG_PRINT("void");
-    int32 id;
+ipc_daemon_ids(const char *list, const int32 count, int32 **ids) {
+    DEBUG_PRINT("%s, %d, %p", list, count, (void *) ids);
+    const char *p = list;
+    int32 size = 16;
+    int32 n = 0;
 
-    if ((passid_fifo.file = fopen(passid_fifo.name, "r")) == NULL) {
-        error("Error opening fifo for reading id: %s\n", strerror(errno));
-        return -1;
+    *ids = util_malloc((usize) size*sizeof (**ids));
+
+    while (true) {
+        long first;
+        long last;
+        char *end;
+
+        errno = 0;
+        first = strtol(p, &end, 10);
+        if ((end == p) || errno)
+            goto invalid;
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if ((end == p) || errno)
+                goto invalid;
+        }
+        p = end;
+
+        if (first < 0)
+            first += count;
+        if (last < 0)
+            last += count;
+        if ((first < 0) || (first >= count) || (last < 0) || (last >= count))
+            goto invalid;
+
+        for (long id = first;; id += (first <= last) ? 1 : -1) {
+            /* repeats can't make it grow past twice the history */
+            if ((n == size) && (n >= 2*count))
+                n = ipc_daemon_ids_unique(*ids, n);
+            if (n == size) {
+                size *= 2;
+                *ids = util_realloc(*ids, (usize) size*sizeof (**ids));
+            }
+            (*ids)[n++] = (int32) id;
+            if (id == last)
+                break;
+        }
+
+        if (*p == '\0')
+            break;
+        if (*p != ',')
+            goto invalid;
+        p += 1;
     }
+    return ipc_daemon_ids_unique(*ids, n);
+
+    invalid:
+    free(*ids);
+    *ids = NULL;
+    return -1;
+}
 
-    if (fread(&id, sizeof (*(&id)), 1, passid_fifo.file) != 1) {
-        error("Error reading id from pipe: %s\n", strerror(errno));
-        return -1;
+/* Drop the repeated ids, keeping the first of each where it is, by
+ * sorting them with their position: id in the high half, so that each
+ * id comes first where it came first. Returns how many are left. */
+int32
+ipc_daemon_ids_unique(int32 *ids, const int32 n) {
+    DEBUG_PRINT("%p, %d", (void *) ids, n);
+    uint64 *keys = util_malloc((usize) MAX(n, 1)*sizeof (*keys));
+    uint64 last = UINT64_MAX;
+    int32 unique = 0;
+
+    for (int32 i = 0; i < n; i += 1)
+        keys[i] = (uint64) ids[i] << 32 | (uint64) i;
+    qsort(keys, (usize) n, sizeof (*keys), ipc_compare_keys);
+
+    for (int32 i = 0; i < n; i += 1) {
+        uint64 id = keys[i] >> 32;
+        if (id == last)
+            continue;
+        last = id;
+        keys[unique++] = (keys[i] & 0xffffffffull) << 32 | id;
     }
+    qsort(keys, (usize) unique, sizeof (*keys), ipc_compare_keys);
 
-    util_close(&passid_fifo);
+    for (int32 i = 0; i < unique; i += 1)
+        ids[i] = (int32) (keys[i] & 0xffffffffull);
+    free(keys);
+    return unique;
+}
+
+int
+ipc_compare_keys(const void *a, const void *b) {
+    uint64 x = *(const uint64 *) a;
+    uint64 y = *(const uint64 *) b;
+    return (x > y) - (x < y);
+}
 
-    return id;
+int
+ipc_compare_ids_down(const void *a, const void *b) {
+    int32 x = *(const int32 *) a;
+    int32 y = *(const int32 *) b;
+    return (x < y) - (x > y);
 }
 
+/* argument is 1 for the Prometheus text format. Printed without the
+ * lock, see stats_memory. */
 void
-ipc_client_ask_id(const int32 id) {
-    DEBUG_PRINT("%d", id);
-    if ((passid_fifo.file = fopen(passid_fifo.name, "w")) == NULL) {
-        util_die_notify("Error opening fifo for sending id to daemon: "
-                        "%s\n", strerror(errno));
-    }
+ipc_daemon_stats(Client *client, const Frame *request) {
+    DEBUG_PRINT("%d, %d", client->fd, request->argument);
+    Reply *reply = ipc_reply_new(1);
+    FILE *stream = ipc_reply_open(reply);
 
-    if (fwrite(&id, sizeof (*(&id)), 1, passid_fifo.file) != 1)
-        error("Error sending id to daemon: %s\n", strerror(errno));
+    stats_print(stream, request->argument == 1);
 
-    util_close(&passid_fifo);
+    ipc_reply_close(reply, stream, 0);
+    ipc_reply_queue(client, reply, request->id, EXIT_SUCCESS);
     return;
 }
 
+/* Sent like --print, best match first. Scoring takes a while on a large
+ * history, so the view is built and searched on a thread of its own,
+ * which search_top() splits further. */
 void
-ipc_make_fifos(void) {
-    DEBUG_PRINT("");
-    ipc_clean_fifo(command_fifo.name);
-    ipc_clean_fifo(passid_fifo.name);
-    ipc_clean_fifo(content_fifo.name);
+ipc_daemon_search(Client *client, const Frame *request, const char *query) {
+    DEBUG_PRINT("%d, %s, %d", client->fd, query, request->argument);
+    HistoryView *view;
+    Job *job;
+    thrd_t thread;
+
+    stats_lock();
+    view = history_view();
+    stats_unlock();
+
+    if (view->count == 0) {
+        ipc_daemon_release(view);
+        error("Clipboard history empty. Start copying text.\n");
+        ipc_daemon_message(client, request, EXIT_SUCCESS,
+                           "000 Clipboard history empty. Start copying text.\n");
+        return;
+    }
+
+    job = ipc_job_new(client, request);
+    job->view = view;
+    job->k = request->argument;
+    strcpy(job->query, query);
 
-    ipc_create_fifo(command_fifo.name);
-    ipc_create_fifo(passid_fifo.name);
-    ipc_create_fifo(content_fifo.name);
+    if (thrd_create(&thread, ipc_search_job, job) != thrd_success) {
+        error("Error creating search thread.\n");
+        ipc_search_job(job);
+        return;
+    }
+    thrd_detach(thread);
     return;
 }
 
+int
+ipc_search_job(void *arg) {
+    Job *job = arg;
+    HistoryView *view = job->view;
+    int32 k = job->k;
+    SearchMatch *matches;
+    FILE *stream;
+    int32 count;
+
+    history_view_entries(view);
+    if ((k <= 0) || (k > view->count))
+        k = view->count;
+
+    job->reply = ipc_reply_new(1);
+    stream = ipc_reply_open(job->reply);
+
+    matches = util_malloc((usize) k*sizeof (*matches));
+    count = search_top(view, job->query, matches, k);
+    for (int32 i = 0; i < count; i += 1) {
+        const Entry *e = &view->entries[matches[i].id];
+        fprintf(stream, "%.*d ", PRINT_DIGITS, matches[i].id);
+        fwrite(e->trimmed, 1, (usize) e->trimmed_length + 1, stream);
+    }
+    free(matches);
+
+    ipc_reply_close(job->reply, stream, 0);
+    job->reply->view = view;
+    job->status = count ? EXIT_SUCCESS : EXIT_FAILURE;
+    ipc_job_done(job);
+    return 0;
+}
+
+/* Sent like --print, newest first. The index is looked up with lock
+ * held, in the same go as the view its ids refer to, and the candidates
+ * it gives are checked against the view once the lock is released. */
 void
-ipc_clean_fifo(const char *name) {
-    DEBUG_PRINT("%s", name);
-    if (unlink(name) < 0) {
-        if (errno != ENOENT) {
-            util_die_notify("Error deleting %s: %s\n", name, strerror(errno));
+ipc_daemon_grep(Client *client, const Frame *request, const char *query) {
+    DEBUG_PRINT("%d, %s", client->fd, query);
+    usize length = strlen(query);
+    HistoryView *view;
+    int32 *ids;
+    Reply *reply;
+    FILE *stream;
+    int32 count;
+    int32 found = 0;
+
+    stats_lock();
+    view = history_view();
+    ids = util_malloc((usize) MAX(view->count, 1)*sizeof (*ids));
+    count = view->count ? trigram_find(query, length, ids) : 0;
+    stats_unlock();
+    history_view_entries(view);
+
+    if (view->count == 0) {
+        free(ids);
+        ipc_daemon_release(view);
+        error("Clipboard history empty. Start copying text.\n");
+        ipc_daemon_message(client, request, EXIT_SUCCESS,
+                           "000 Clipboard history empty. Start copying text.\n");
+        return;
+    }
+    if (count < 0) {
+        count = 0;
+        for (int32 id = view->count - 1; id >= 0; id -= 1) {
+            if (view->entries[id].image_path == NULL)
+                ids[count++] = id;
         }
     }
+
+    reply = ipc_reply_new(1);
+    stream = ipc_reply_open(reply);
+    for (int32 i = 0; i < count; i += 1) {
+        const Entry *e = &view->entries[ids[i]];
+        if (!memmem(e->content, (usize) e->content_length, query, length))
+            continue;
+        fprintf(stream, "%.*d ", PRINT_DIGITS, ids[i]);
+        fwrite(e->trimmed, 1, (usize) e->trimmed_length + 1, stream);
+        found += 1;
+    }
+    free(ids);
+
+    ipc_reply_close(reply, stream, 0);
+    reply->view = view;
+    ipc_reply_queue(client, reply, request->id,
+                    found ? EXIT_SUCCESS : EXIT_FAILURE);
     return;
 }
 
+/* query is the payload of the request, if not NULL. The command line
+ * sends a single request, with id 1, and exits with the status of the
+ * reply if it is not a success. */
 void
-ipc_create_fifo(const char *name) {
-    DEBUG_PRINT("%s", name);
-    if (mkfifo(name, 0600) < 0) {
-        if (errno != EEXIST) {
-            util_die_notify("Error creating fifo %s: %s\n",
-                            name, strerror(errno));
+ipc_client_speak(uint command, int32 id, const char *query) {
+    DEBUG_PRINT("%u, %d, %s", command, id, query);
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    Frame request = {
+        .length = query ? strlen(query) : 0,
+        .id = 1,
+        .version = IPC_VERSION,
+        .type = (uint16) command,
+        .argument = id,
+    };
+    struct iovec iov[2] = {
+        { .iov_base = &request, .iov_len = sizeof (request) },
+        { .iov_base = (char *) query, .iov_len = request.length },
+    };
+    int server;
+    int status;
+
+    if ((command == COMMAND_SEARCH) || (command == COMMAND_GREP)) {
+        if (request.length >= SEARCH_QUERY_MAX) {
+            error("Query is longer than %d bytes.\n", SEARCH_QUERY_MAX - 1);
+            exit(EXIT_FAILURE);
         }
+    } else if (request.length >= IPC_LIST_MAX) {
+        error("List of entries is longer than %d bytes.\n", IPC_LIST_MAX - 1);
+        exit(EXIT_FAILURE);
     }
+
+    strncpy(address.sun_path, socket_name, sizeof (address.sun_path) - 1);
+    if ((server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        error("Error creating socket: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (connect(server, (struct sockaddr *) &address, sizeof (address)) < 0) {
+        error("Could not connect to %s: %s. "
+              "Is `%s --daemon` running?\n",
+              socket_name, strerror(errno), "clipsim");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!util_writev_all(server, iov, 2)) {
+        error("Error writing command to %s: %s\n",
+              socket_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (command == COMMAND_SAVE)
+        error("Trying to save history...\n");
+    status = ipc_client_receive(server, &request);
+    close(server);
+    if (command == COMMAND_SAVE) {
+        if (status == EXIT_SUCCESS)
+            error("History saved to disk.\n");
+        else
+            error("Error saving history to disk.\n");
+    }
+
+    if (status != EXIT_SUCCESS)
+        exit(status);
     return;
 }
+
+bool
+ipc_client_read(int server, void *buffer, usize length) {
+    char *p = buffer;
+
+    while (length > 0) {
+        isize r = read(server, p, length);
+        if (r <= 0) {
+            if ((r < 0) && (errno == EINTR))
+                continue;
+            return false;
+        }
+        p += r;
+        length -= (usize) r;
+    }
+    return true;
+}
+
+/* Write the data of the reply to stdout, spliced when stdout is a pipe,
+ * as it is for pickers. An image is shown instead. Returns the status of
+ * the reply. */
+int
+ipc_client_receive(int server, const Frame *request) {
+    DEBUG_PRINT("%d, %u", server, request->id);
+    char image[PATH_MAX];
+    bool first = true;
+    bool is_image = false;
+    Frame frame;
+
+    errno = 0;
+    while (ipc_client_read(server, &frame, sizeof (frame))) {
+        if ((frame.version != IPC_VERSION) || (frame.id != request->id)) {
+            error("Invalid reply from %s.\n", socket_name);
+            exit(EXIT_FAILURE);
+        }
+        if (frame.type == FRAME_END) {
+            if (is_image)
+                ipc_client_preview(image);
+            return frame.argument;
+        }
+        if (frame.length == 0)
+            continue;
+
+        if (first) {
+            first = false;
+            if (!ipc_client_read(server, image, 1))
+                break;
+            frame.length -= 1;
+            if (image[0] == IMAGE_TAG) {
+                if (frame.length >= sizeof (image))
+                    util_die_notify("Image name is too long.\n");
+                if (!ipc_client_read(server, image, frame.length))
+                    break;
+                image[frame.length] = '\0';
+                is_image = true;
+                continue;
+            }
+            if (!util_write_all(STDOUT_FILENO, image, 1)) {
+                error("Error writing to stdout: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (!util_splice(server, STDOUT_FILENO, frame.length)) {
+            error("Error writing to stdout: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    error("Error reading data from %s: %s\n", socket_name,
+          errno ? strerror(errno) : "connection closed");
+    exit(EXIT_FAILURE);
+}
+
+void
+ipc_client_preview(const char *image) {
+    DEBUG_PRINT("%s", image);
+    char *CLIPSIM_IMAGE_PREVIEW;
+    int test;
+
+    if ((test = open(image, O_RDONLY)) >= 0) {
+        close(test);
+    } else {
+        error("Error opening %s: %s\n", image, strerror(errno));
+        return;
+    }
+
+    CLIPSIM_IMAGE_PREVIEW = getenv("CLIPSIM_IMAGE_PREVIEW");
+    if (CLIPSIM_IMAGE_PREVIEW == NULL)
+        CLIPSIM_IMAGE_PREVIEW = "chafa";
+    if (!strcmp(CLIPSIM_IMAGE_PREVIEW, "stiv_draw"))
+        execlp("stiv_draw", "stiv_draw", image, "30", "15", NULL);
+    else
+        execlp("chafa", "chafa", image, "-s", "40x", NULL);
+    return;
+}
+
+int
+ipc_daemon_make_socket(void) {
+    DEBUG_PRINT("void");
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    int listen_fd;
+
+    if (strlen(socket_name) >= sizeof (address.sun_path))
+        util_die_notify("Socket path %s is too long.\n", socket_name);
+    strcpy(address.sun_path, socket_name);
+
+    if (unlink(socket_name) < 0) {
+        if (errno != ENOENT) {
+            util_die_notify("Error deleting %s: %s\n",
+                            socket_name, strerror(errno));
+        }
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+        util_die_notify("Error creating socket: %s\n", strerror(errno));
+    if (bind(listen_fd, (struct sockaddr *) &address, sizeof (address)) < 0) {
+        util_die_notify("Error binding socket to %s: %s\n",
+                        socket_name, strerror(errno));
+    }
+    if (chmod(socket_name, S_IRUSR | S_IWUSR) < 0)
+        error("Error setting permissions of %s: %s\n",
+              socket_name, strerror(errno));
+    if (listen(listen_fd, SOMAXCONN) < 0)
+        util_die_notify("Error listening on %s: %s\n",
+                        socket_name, strerror(errno));
+    return listen_fd;
+}
+
+/* data is the client, NULL for the listening socket and &done for the
+ * jobs. */
+bool
+ipc_epoll_add(int fd, void *data, uint32 events) {
+    DEBUG_PRINT("%d, %p, %u", fd, data, events);
+    struct epoll_event event = { .events = events, .data.ptr = data };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        error("Error adding %d to epoll: %s\n", fd, strerror(errno));
+        close(fd);
+        return false;
+    }
+    return true;
+}
@@ -27,20 +27,25 @@ static const Command commands[] = {
     [COMMAND_PRINT]  = {"-p", "--print",
                         "print entire history, with trimmed whitespace" },
     [COMMAND_INFO]   = {"-i", "--info",
-                        "print entry number <n>, with original whitespace" },
+                        "print entries <n>, like 3-17,22, with original whitespace" },
     [COMMAND_COPY]   = {"-c", "--copy",
-                        "copy entry number <n>, with original whitespace" },
+                        "copy entries <n>, the last one given to the clipboard" },
     [COMMAND_REMOVE] = {"-r", "--remove",
-                        "remove entry number <n>" },
+                        "remove entries <n>, like 3-17,22" },
     [COMMAND_SAVE]   = {"-s", "--save",
                         "save history to $XDG_CACHE_HOME/clipsim/history" },
+    [COMMAND_STATS]  = {"-t", "--stats",
+                        "print daemon statistics, [prometheus] for textfiles" },
+    [COMMAND_SEARCH] = {"-f", "--search",
+                        "print the [k] entries best matching <query>" },
+    [COMMAND_GREP]   = {"-g", "--grep",
+                        "print the entries containing <text>" },
     [COMMAND_DAEMON] = {"-d", "--daemon",
-                        "spawn daemon (clipboard watcher and command fifo)" },
+                        "spawn daemon (clipboard watcher and command socket)" },
     [COMMAND_HELP]   = {"-h", "--help",
                         "print this help message" },
 };
 
-Entry entries[HISTORY_BUFFER_SIZE] = {0};
 const char TEXT_TAG = (char) 0x01;
 const char IMAGE_TAG = (char) 0x02;
 mtx_t lock;
@@ -60,26 +65,57 @@ int main(int argc, char *argv[]) {
 
     signal(SIGSEGV, util_segv_handler);
 
-    if (argc <= 1 || argc >= 4)
+    if (argc <= 1 || argc >= 5)
         main_usage(stderr);
 
     for (uint i = 0; i < LENGTH(commands); i += 1) {
         if (!strcmp(argv[1], commands[i].shortname)
             || !strcmp(argv[1], commands[i].longname)) {
             spell_error = false;
+            if ((argc == 4) && (i != COMMAND_SEARCH))
+                main_usage(stderr);
             switch (i) {
             case COMMAND_PRINT:
-                ipc_client_speak_fifo(COMMAND_PRINT, 0);
+                ipc_client_speak(COMMAND_PRINT, 0, NULL);
                 break;
             case COMMAND_INFO:
             case COMMAND_COPY:
             case COMMAND_REMOVE:
-                if ((argc != 3) || util_string_int32(&id, argv[2]) < 0)
+                if (argc != 3)
+                    main_usage(stderr);
+                /* a list of ids and ranges is resolved by the daemon */
+                if (util_string_int32(&id, argv[2]) >= 0)
+                    ipc_client_speak(i, id, NULL);
+                else if (argv[2][strspn(argv[2], "0123456789-,")] == '\0')
+                    ipc_client_speak(i, 0, argv[2]);
+                else
                     main_usage(stderr);
-                ipc_client_speak_fifo(i, id);
                 break;
             case COMMAND_SAVE:
-                ipc_client_speak_fifo(COMMAND_SAVE, 0);
+                ipc_client_speak(COMMAND_SAVE, 0, NULL);
+                break;
+            case COMMAND_STATS:
+                if (argc == 2)
+                    ipc_client_speak(COMMAND_STATS, 0, NULL);
+                else if (!strcmp(argv[2], "prometheus"))
+                    ipc_client_speak(COMMAND_STATS, 1, NULL);
+                else
+                    main_usage(stderr);
+                break;
+            case COMMAND_SEARCH:
+                id = SEARCH_TOP_K;
+                if (argc < 3)
+                    main_usage(stderr);
+                if ((argc == 4)
+                    && ((util_string_int32(&id, argv[3]) < 0) || (id <= 0))) {
+                    main_usage(stderr);
+                }
+                ipc_client_speak(COMMAND_SEARCH, id, argv[2]);
+                break;
+            case COMMAND_GREP:
+                if (argc != 3)
+                    main_usage(stderr);
+                ipc_client_speak(COMMAND_GREP, 0, argv[2]);
                 break;
             case COMMAND_DAEMON:
                 main_launch_daemon();
@@ -100,13 +136,17 @@ int main(int argc, char *argv[]) {
 void
 main_usage(FILE *stream) {
     DEBUG_PRINT("%p", (void *) stream);
-    fprintf(stream, "usage: %s COMMAND [n]\n", "clipsim");
+    fprintf(stream, "usage: %s COMMAND [<n>]\n", "clipsim");
     fprintf(stream, "Available commands:\n");
     for (uint i = 0; i < LENGTH(commands); i += 1) {
         fprintf(stream, "%s | %-*s : %s\n",
                 commands[i].shortname, 8, commands[i].longname, 
                 commands[i].description);
     }
+    fprintf(stream, "<n> is an entry number or a list of them and ranges, "
+                    "like 3-17,22.\n"
+                    "Negative numbers count from the newest entry, "
+                    "so -3--1 are the newest three.\n");
     exit(stream != stdout);
 }
 
@@ -192,8 +232,11 @@ main_launch_daemon(void) {
         exit(EXIT_FAILURE);
     }
 
+    signal(SIGPIPE, SIG_IGN);
+    stats_start();
     history_read();
+    history_writer_start();
 
-    thrd_create(&ipc_thread, ipc_daemon_listen_fifo, NULL);
+    thrd_create(&ipc_thread, ipc_daemon_listen, NULL);
     clipboard_daemon_watch();
 }
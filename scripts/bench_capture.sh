@@ -0,0 +1,55 @@
+#!/bin/sh
+
+# usage: $0 [clipsim-bench-capture options]
+# Start a headless Xvfb and a clipsim daemon with an empty cache, then
+# measure how fast copies land in history. See bench_capture.c.
+# Only one clipsim daemon can run at a time, so stop yours first.
+
+clipsim="${CLIPSIM:-./clipsim}"
+capture="${CLIPSIM_BENCH_CAPTURE:-./clipsim-bench-capture}"
+
+command -v Xvfb > /dev/null || { echo "Xvfb not found." >&2; exit 1; }
+
+cache="$(mktemp -d)" || exit 1
+trap 'kill $daemon $xvfb 2> /dev/null; rm -rf "$cache"' EXIT
+trap 'exit 1' INT TERM
+
+# Xvfb picks a free display and writes its number to fd 3
+Xvfb -displayfd 3 -nolisten tcp 3> "$cache/display" > "$cache/xvfb.log" 2>&1 &
+xvfb=$!
+i=0
+until [ -s "$cache/display" ]; do
+    i=$((i + 1))
+    if [ $i -gt 50 ] || ! kill -0 $xvfb 2> /dev/null; then
+        echo "Xvfb did not start:" >&2
+        cat "$cache/xvfb.log" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+# the journal is made before the display is opened, so the daemon must
+# also still be running a moment after it appears
+export DISPLAY=":$(cat "$cache/display")"
+export XDG_CACHE_HOME="$cache"
+"$clipsim" --daemon 2> "$cache/daemon.log" &
+daemon=$!
+i=0
+until [ -f "$cache/clipsim/history.journal" ] && [ $i -gt 5 ]; do
+    i=$((i + 1))
+    if [ $i -gt 50 ] || ! kill -0 $daemon 2> /dev/null; then
+        echo "clipsim daemon did not start:" >&2
+        cat "$cache/daemon.log" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+"$capture" "$@"
+status=$?
+if ! kill -0 $daemon 2> /dev/null; then
+    echo "clipsim daemon exited during the benchmark:" >&2
+    cat "$cache/daemon.log" >&2
+    exit 1
+fi
+exit $status
@@ -0,0 +1,395 @@
+/* This file is part of clipsim.
+ * Copyright (C) 2023 Lucas Mior
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "clipsim.h"
+
+/* Scores are the ones of fzf's v1 algorithm: each matched character is
+ * worth SCORE_MATCH, gaps between them cost, and matches at the start
+ * of a word, after a delimiter or at a camelCase hump get a bonus which
+ * is doubled for the first character of a term. */
+#define SCORE_MATCH 16
+#define SCORE_GAP_START -3
+#define SCORE_GAP_EXTENSION -1
+#define BONUS_BOUNDARY (SCORE_MATCH / 2)
+#define BONUS_BOUNDARY_WHITE (BONUS_BOUNDARY + 2)
+#define BONUS_BOUNDARY_DELIMITER (BONUS_BOUNDARY + 1)
+#define BONUS_NONWORD (SCORE_MATCH / 2)
+#define BONUS_CAMEL (BONUS_BOUNDARY - 1)
+#define BONUS_CONSECUTIVE -(SCORE_GAP_START + SCORE_GAP_EXTENSION)
+#define BONUS_FIRST_MULTIPLIER 2
+
+#define SEARCH_MAX_TERMS 16
+#define SEARCH_CHUNK 64
+#define SEARCH_THREAD_BYTES (1 << 20)
+
+/* Ordered as in fzf, bonuses compare classes. */
+enum {
+    CHAR_WHITE,
+    CHAR_NONWORD,
+    CHAR_DELIMITER,
+    CHAR_LOWER,
+    CHAR_UPPER,
+    CHAR_LETTER,
+    CHAR_NUMBER,
+};
+
+typedef struct Term {
+    const char *text;
+    usize length;
+} Term;
+
+typedef struct Search {
+    const Entry *entries;
+    Term terms[SEARCH_MAX_TERMS];
+    int32 nterms;
+    int32 count;
+    int32 k;
+    int32 next;
+    bool case_sensitive;
+} Search;
+
+typedef struct Worker {
+    Search *search;
+    SearchMatch *heap;
+    int32 size;
+    int32 unused;
+    thrd_t thread;
+} Worker;
+
+static int search_worker(void *);
+static int32 search_entry(const Search *, const Entry *);
+static int32 search_text(const Search *, const char *, const usize);
+static int32 search_term(const char *, const usize, const Term *, const bool);
+static int search_class(const uchar);
+static int32 search_bonus(const int, const int);
+static bool search_better(const SearchMatch *, const SearchMatch *);
+static void search_push(SearchMatch *, int32 *, const int32, SearchMatch);
+static SearchMatch search_pop(SearchMatch *, int32 *);
+static void search_sift_down(SearchMatch *, const int32, SearchMatch);
+
+/* Score every entry of view against the space separated terms of query,
+ * putting the k best in matches, best first. The view does not change,
+ * so the lock is not needed. Large histories are split in chunks that
+ * worker threads take in turns. */
+int32
+search_top(const HistoryView *view, const char *query,
+           SearchMatch *matches, const int32 k) {
+    DEBUG_PRINT("%p, %s, %p, %d", (void *) view, query, (void *) matches, k);
+    char folded[SEARCH_QUERY_MAX];
+    Worker workers[SEARCH_MAX_THREADS];
+    Search search = {0};
+    int32 nworkers;
+    int32 size = 0;
+    usize total = 0;
+    long cpus;
+
+    search.count = view->count;
+    if ((search.count == 0) || (k <= 0))
+        return 0;
+    search.k = k;
+
+    /* smart case, like fzf: only a query with capitals is case sensitive */
+    for (usize i = 0; query[i] && (i < sizeof (folded) - 1); i += 1) {
+        if ((query[i] >= 'A') && (query[i] <= 'Z'))
+            search.case_sensitive = true;
+    }
+    for (usize i = 0; i < sizeof (folded); i += 1) {
+        char c = query[i];
+        if (!search.case_sensitive && (c >= 'A') && (c <= 'Z'))
+            c += 'a' - 'A';
+        folded[i] = c;
+        if (c == '\0')
+            break;
+    }
+    folded[sizeof (folded) - 1] = '\0';
+
+    for (char *p = folded; *p && (search.nterms < SEARCH_MAX_TERMS);) {
+        Term *term = &search.terms[search.nterms];
+        while (*p == ' ')
+            p += 1;
+        if (*p == '\0')
+            break;
+        term->text = p;
+        while (*p && (*p != ' '))
+            p += 1;
+        term->length = (usize) (p - term->text);
+        search.nterms += 1;
+    }
+
+    /* ids count from the oldest entry, like the view */
+    search.entries = view->entries;
+    for (int32 id = 0; id < search.count; id += 1)
+        total += (usize) search.entries[id].content_length;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nworkers = (int32) MIN(total / SEARCH_THREAD_BYTES + 1,
+                           (usize) search.count / SEARCH_CHUNK + 1);
+    nworkers = MIN(nworkers, MIN(SEARCH_MAX_THREADS, (int32) MAX(cpus, 1)));
+
+    for (int32 i = 0; i < nworkers; i += 1) {
+        workers[i].search = &search;
+        workers[i].heap = util_malloc((usize) k*sizeof (*workers[i].heap));
+        workers[i].size = 0;
+    }
+    /* the first worker is this thread, and so are the ones that fail */
+    for (int32 i = 1; i < nworkers; i += 1) {
+        if (thrd_create(&workers[i].thread, search_worker,
+                        &workers[i]) != thrd_success) {
+            error("Error creating search thread.\n");
+            nworkers = i;
+            break;
+        }
+    }
+    search_worker(&workers[0]);
+
+    for (int32 i = 0; i < nworkers; i += 1) {
+        if (i > 0)
+            thrd_join(workers[i].thread, NULL);
+        for (int32 j = 0; j < workers[i].size; j += 1)
+            search_push(matches, &size, k, workers[i].heap[j]);
+        free(workers[i].heap);
+    }
+
+    /* popping the worst match each time leaves them best first */
+    for (int32 n = size; n > 0; n -= 1) {
+        int32 heap_size = n;
+        SearchMatch worst = search_pop(matches, &heap_size);
+        matches[n - 1] = worst;
+    }
+    return size;
+}
+
+int
+search_worker(void *arg) {
+    Worker *worker = arg;
+    Search *search = worker->search;
+    int32 start;
+
+    while ((start = __atomic_fetch_add(&(search->next), SEARCH_CHUNK,
+                                       __ATOMIC_RELAXED)) < search->count) {
+        int32 end = MIN(start + SEARCH_CHUNK, search->count);
+        for (int32 id = start; id < end; id += 1) {
+            SearchMatch match = { .id = id };
+            if ((match.score = search_entry(search, &search->entries[id])) < 0)
+                continue;
+            search_push(worker->heap, &(worker->size), search->k, match);
+        }
+    }
+    return 0;
+}
+
+/* Best score of the full content and the preview, -1 if neither has
+ * every term. */
+int32
+search_entry(const Search *search, const Entry *e) {
+    int32 score = search_text(search, e->content, (usize) e->content_length);
+
+    if (e->trimmed != e->content) {
+        int32 trimmed = search_text(search, e->trimmed,
+                                    (usize) e->trimmed_length);
+        score = MAX(score, trimmed);
+    }
+    return score;
+}
+
+int32
+search_text(const Search *search, const char *text, const usize length) {
+    int32 score = 0;
+
+    for (int32 i = 0; i < search->nterms; i += 1) {
+        int32 s = search_term(text, length, &search->terms[i],
+                              search->case_sensitive);
+        if (s < 0)
+            return -1;
+        score += s;
+    }
+    return score;
+}
+
+/* The first occurrence of the term as a subsequence is found scanning
+ * forward, then scanning back from its end gives the shortest one ending
+ * there, which is scored. */
+int32
+search_term(const char *text, const usize length,
+            const Term *term, const bool case_sensitive) {
+    usize start = 0;
+    usize end = 0;
+    usize t = 0;
+    int32 score = 0;
+    int32 consecutive = 0;
+    int32 first_bonus = 0;
+    bool in_gap = false;
+    int previous;
+
+#define FOLD(c) \
+    ((!case_sensitive && ((c) >= 'A') && ((c) <= 'Z')) ? (c) + 'a' - 'A' : (c))
+
+    for (usize i = 0; i < length; i += 1) {
+        if (FOLD(text[i]) != term->text[t])
+            continue;
+        if (t == 0)
+            start = i;
+        if ((t += 1) == term->length) {
+            end = i + 1;
+            break;
+        }
+    }
+    if (t < term->length)
+        return -1;
+
+    for (usize i = end; i > start; i -= 1) {
+        if (FOLD(text[i - 1]) != term->text[t - 1])
+            continue;
+        if ((t -= 1) == 0) {
+            start = i - 1;
+            break;
+        }
+    }
+
+    previous = start > 0 ? search_class((uchar) text[start - 1]) : CHAR_WHITE;
+    for (usize i = start; i < end; i += 1) {
+        int class = search_class((uchar) text[i]);
+
+        if ((t < term->length) && (FOLD(text[i]) == term->text[t])) {
+            int32 bonus = search_bonus(previous, class);
+
+            score += SCORE_MATCH;
+            if (consecutive == 0) {
+                first_bonus = bonus;
+            } else {
+                if ((bonus >= BONUS_BOUNDARY) && (bonus > first_bonus))
+                    first_bonus = bonus;
+                bonus = MAX(MAX(bonus, first_bonus), BONUS_CONSECUTIVE);
+            }
+            score += t == 0 ? bonus*BONUS_FIRST_MULTIPLIER : bonus;
+            consecutive += 1;
+            in_gap = false;
+            t += 1;
+        } else {
+            score += in_gap ? SCORE_GAP_EXTENSION : SCORE_GAP_START;
+            consecutive = 0;
+            first_bonus = 0;
+            in_gap = true;
+        }
+        previous = class;
+    }
+#undef FOLD
+    return MAX(score, 0);
+}
+
+int
+search_class(const uchar c) {
+    if ((c >= 'a') && (c <= 'z'))
+        return CHAR_LOWER;
+    if ((c >= 'A') && (c <= 'Z'))
+        return CHAR_UPPER;
+    if ((c >= '0') && (c <= '9'))
+        return CHAR_NUMBER;
+    if (IS_SPACE(c) || (c == '\r'))
+        return CHAR_WHITE;
+    if ((c == '/') || (c == ',') || (c == ':') || (c == ';') || (c == '|'))
+        return CHAR_DELIMITER;
+    if (c >= 0x80)
+        return CHAR_LETTER;
+    return CHAR_NONWORD;
+}
+
+int32
+search_bonus(const int previous, const int class) {
+    if (class > CHAR_NONWORD) {
+        switch (previous) {
+        case CHAR_WHITE:
+            return BONUS_BOUNDARY_WHITE;
+        case CHAR_DELIMITER:
+            return BONUS_BOUNDARY_DELIMITER;
+        case CHAR_NONWORD:
+            return BONUS_BOUNDARY;
+        }
+    }
+    if (((previous == CHAR_LOWER) && (class == CHAR_UPPER))
+        || ((previous != CHAR_NUMBER) && (class == CHAR_NUMBER))) {
+        return BONUS_CAMEL;
+    }
+    switch (class) {
+    case CHAR_NONWORD:
+    case CHAR_DELIMITER:
+        return BONUS_NONWORD;
+    case CHAR_WHITE:
+        return BONUS_BOUNDARY_WHITE;
+    }
+    return 0;
+}
+
+/* Ties go to the newest entry. */
+bool
+search_better(const SearchMatch *a, const SearchMatch *b) {
+    if (a->score != b->score)
+        return a->score > b->score;
+    return a->id > b->id;
+}
+
+/* Keeps the k best matches in a heap with the worst one on top. */
+void
+search_push(SearchMatch *heap, int32 *size, const int32 k, SearchMatch match) {
+    int32 i;
+
+    if (*size == k) {
+        if (search_better(&match, &heap[0]))
+            search_sift_down(heap, *size, match);
+        return;
+    }
+
+    i = *size;
+    *size += 1;
+    while (i > 0) {
+        int32 parent = (i - 1) / 2;
+        if (!search_better(&heap[parent], &match))
+            break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = match;
+    return;
+}
+
+SearchMatch
+search_pop(SearchMatch *heap, int32 *size) {
+    SearchMatch worst = heap[0];
+
+    *size -= 1;
+    if (*size > 0)
+        search_sift_down(heap, *size, heap[*size]);
+    return worst;
+}
+
+/* Put match on top, in place of the current one, and let it sink. */
+void
+search_sift_down(SearchMatch *heap, const int32 size, SearchMatch match) {
+    int32 i = 0;
+
+    while (2*i + 1 < size) {
+        int32 child = 2*i + 1;
+        if ((child + 1 < size) && search_better(&heap[child], &heap[child + 1]))
+            child += 1;
+        if (!search_better(&match, &heap[child]))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = match;
+    return;
+}
@@ -0,0 +1,299 @@
+/* This file is part of clipsim.
+ * Copyright (C) 2023 Lucas Mior
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "clipsim.h"
+
+/* Durations go to power of two buckets, the first one holding everything
+ * up to 2^STATS_MIN_SHIFT ns (about 1 us) and the last one everything
+ * above 2^(STATS_MIN_SHIFT + STATS_BUCKETS - 2) ns (about 8.6 s). */
+#define STATS_MIN_SHIFT 10
+#define STATS_BUCKETS 25
+
+#define STATS_ADD(x, n) __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+#define STATS_LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+typedef struct Histogram {
+    uint64 buckets[STATS_BUCKETS];
+    uint64 count;
+    uint64 sum;
+    uint64 max;
+} Histogram;
+
+static const char *stage_names[STATS_STAGES] = {
+    [STATS_CONVERT]   = "convert",
+    [STATS_CLASSIFY]  = "classify",
+    [STATS_DEDUP]     = "dedup",
+    [STATS_TRIM]      = "trim",
+    [STATS_JOURNAL]   = "journal",
+    [STATS_SYNC]      = "sync",
+    [STATS_SAVE]      = "save",
+    [STATS_LOCK_WAIT] = "lock_wait",
+    [STATS_LOCK_HOLD] = "lock_hold",
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} counters_info[STATS_COUNTERS] = {
+    [STATS_EVENTS]      = { "events",      "Clipboard owner changes seen" },
+    [STATS_CONVERSIONS] = { "conversions", "Selections converted" },
+    [STATS_ENTRIES]     = { "entries",     "Entries added to history" },
+    [STATS_DUPLICATES]  = { "duplicates",  "Copies already in history" },
+    [STATS_REJECTED]    = { "rejected",    "Copies not added to history" },
+    [STATS_BYTES]       = { "bytes",       "Bytes added to history" },
+    [STATS_REQUESTS]    = { "requests",    "Commands served" },
+};
+
+static Histogram histograms[STATS_STAGES];
+static uint64 counters[STATS_COUNTERS];
+static uint64 lock_acquired;
+static uint64 started;
+
+static uint64 stats_percentile(const Histogram *, const uint64);
+static double stats_bound(const int);
+static void stats_print_human(FILE *);
+static void stats_print_prometheus(FILE *);
+static void stats_memory(usize *, usize *, usize *, int32 *);
+
+uint64
+stats_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64) t.tv_sec*1000000000ull + (uint64) t.tv_nsec;
+}
+
+/* Account the time elapsed since start, taken with stats_now(). */
+void
+stats_record(const int stage, const uint64 start) {
+    Histogram *h = &histograms[stage];
+    uint64 elapsed = stats_now() - start;
+    int bucket = 0;
+    uint64 max;
+
+    if (elapsed)
+        bucket = 64 - __builtin_clzll(elapsed) - STATS_MIN_SHIFT;
+    bucket = MIN(MAX(bucket, 0), STATS_BUCKETS - 1);
+
+    STATS_ADD(h->buckets[bucket], 1);
+    STATS_ADD(h->count, 1);
+    STATS_ADD(h->sum, elapsed);
+
+    max = STATS_LOAD(h->max);
+    while ((elapsed > max)
+           && !__atomic_compare_exchange_n(&(h->max), &max, elapsed, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return;
+}
+
+void
+stats_count(const int counter, const uint64 n) {
+    STATS_ADD(counters[counter], n);
+    return;
+}
+
+/* Take the global lock, measuring how long it took to get it. */
+void
+stats_lock(void) {
+    uint64 start = stats_now();
+
+    mtx_lock(&lock);
+    stats_record(STATS_LOCK_WAIT, start);
+    lock_acquired = stats_now();
+    return;
+}
+
+void
+stats_unlock(void) {
+    stats_record(STATS_LOCK_HOLD, lock_acquired);
+    mtx_unlock(&lock);
+    return;
+}
+
+/* Wait on cond, which lets go of the global lock meanwhile, so the hold
+ * ends here and a new one starts on wake up. No deadline if NULL. */
+void
+stats_wait(cnd_t *cond, const struct timespec *deadline) {
+    stats_record(STATS_LOCK_HOLD, lock_acquired);
+    if (deadline)
+        cnd_timedwait(cond, &lock, deadline);
+    else
+        cnd_wait(cond, &lock);
+    lock_acquired = stats_now();
+    return;
+}
+
+/* Called without the lock, stats_memory takes it briefly. */
+void
+stats_print(FILE *stream, const bool prometheus) {
+    DEBUG_PRINT("%p, %d", (void *) stream, prometheus);
+    if (prometheus)
+        stats_print_prometheus(stream);
+    else
+        stats_print_human(stream);
+    return;
+}
+
+void
+stats_start(void) {
+    started = stats_now();
+    return;
+}
+
+/* Upper bound of the bucket holding the q-th percentile, capped at the
+ * largest sample seen. */
+uint64
+stats_percentile(const Histogram *h, const uint64 q) {
+    uint64 count = STATS_LOAD(h->count);
+    uint64 rank = (count*q + 99) / 100;
+    uint64 seen = 0;
+
+    if (count == 0)
+        return 0;
+    for (int i = 0; i < STATS_BUCKETS - 1; i += 1) {
+        seen += STATS_LOAD(h->buckets[i]);
+        if (seen >= rank)
+            return MIN(1ull << (i + STATS_MIN_SHIFT), STATS_LOAD(h->max));
+    }
+    return STATS_LOAD(h->max);
+}
+
+double
+stats_bound(const int bucket) {
+    return (double) (1ull << (bucket + STATS_MIN_SHIFT)) / 1e9;
+}
+
+/* Only reading the history's totals takes the lock. */
+void
+stats_memory(usize *resident, usize *slabs, usize *content, int32 *entries) {
+    FILE *statm;
+    ulong pages = 0;
+
+    *resident = 0;
+    if ((statm = fopen("/proc/self/statm", "r"))) {
+        if (fscanf(statm, "%*u %lu", &pages) == 1)
+            *resident = (usize) pages*(usize) sysconf(_SC_PAGESIZE);
+        fclose(statm);
+    }
+
+    stats_lock();
+    *slabs = util_slab_mapped();
+    *content = history_content_bytes();
+    *entries = history_lastindex() + 1;
+    stats_unlock();
+    return;
+}
+
+void
+stats_print_human(FILE *stream) {
+    usize resident;
+    usize slabs;
+    usize content;
+    int32 entries;
+    uint64 uptime = (stats_now() - started) / 1000000000ull;
+
+    fprintf(stream, "uptime: %lud %02luh %02lum %02lus\n\n",
+            uptime / 86400, uptime / 3600 % 24, uptime / 60 % 60, uptime % 60);
+
+    /* percentiles are the upper bounds of their buckets */
+    fprintf(stream, "%-10s %10s %12s %12s %12s %12s\n",
+            "stage", "count", "mean (us)", "p50 (us)", "p99 (us)", "max (us)");
+    for (int i = 0; i < STATS_STAGES; i += 1) {
+        Histogram *h = &histograms[i];
+        uint64 count = STATS_LOAD(h->count);
+        fprintf(stream, "%-10s %10lu %12.1f %12.1f %12.1f %12.1f\n",
+                stage_names[i], count,
+                count ? (double) STATS_LOAD(h->sum) / (double) count / 1e3 : 0,
+                (double) stats_percentile(h, 50) / 1e3,
+                (double) stats_percentile(h, 99) / 1e3,
+                (double) STATS_LOAD(h->max) / 1e3);
+    }
+
+    fprintf(stream, "\n");
+    for (int i = 0; i < STATS_COUNTERS; i += 1) {
+        fprintf(stream, "%-12s %lu\n",
+                counters_info[i].name, STATS_LOAD(counters[i]));
+    }
+
+    stats_memory(&resident, &slabs, &content, &entries);
+    fprintf(stream, "\n");
+    fprintf(stream, "history entries: %d\n", entries);
+    fprintf(stream, "content bytes:   %zu\n", content);
+    fprintf(stream, "slab bytes:      %zu\n", slabs);
+    fprintf(stream, "resident bytes:  %zu\n", resident);
+    return;
+}
+
+/* Text exposition format, for node_exporter's textfile collector. */
+void
+stats_print_prometheus(FILE *stream) {
+    usize resident;
+    usize slabs;
+    usize content;
+    int32 entries;
+    uint64 uptime = (stats_now() - started) / 1000000000ull;
+
+    fprintf(stream, "# HELP clipsim_stage_duration_seconds "
+                    "Time spent in each stage of handling the clipboard.\n");
+    fprintf(stream, "# TYPE clipsim_stage_duration_seconds histogram\n");
+    for (int i = 0; i < STATS_STAGES; i += 1) {
+        Histogram *h = &histograms[i];
+        uint64 cumulative = 0;
+
+        for (int b = 0; b < STATS_BUCKETS - 1; b += 1) {
+            cumulative += STATS_LOAD(h->buckets[b]);
+            fprintf(stream, "clipsim_stage_duration_seconds_bucket"
+                            "{stage=\"%s\",le=\"%g\"} %lu\n",
+                            stage_names[i], stats_bound(b), cumulative);
+        }
+        fprintf(stream, "clipsim_stage_duration_seconds_bucket"
+                        "{stage=\"%s\",le=\"+Inf\"} %lu\n",
+                        stage_names[i], STATS_LOAD(h->count));
+        fprintf(stream, "clipsim_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n",
+                        stage_names[i], (double) STATS_LOAD(h->sum) / 1e9);
+        fprintf(stream, "clipsim_stage_duration_seconds_count{stage=\"%s\"} %lu\n",
+                        stage_names[i], STATS_LOAD(h->count));
+    }
+
+    for (int i = 0; i < STATS_COUNTERS; i += 1) {
+        fprintf(stream, "# HELP clipsim_%s_total %s.\n",
+                        counters_info[i].name, counters_info[i].help);
+        fprintf(stream, "# TYPE clipsim_%s_total counter\n",
+                        counters_info[i].name);
+        fprintf(stream, "clipsim_%s_total %lu\n",
+                        counters_info[i].name, STATS_LOAD(counters[i]));
+    }
+
+    stats_memory(&resident, &slabs, &content, &entries);
+    fprintf(stream, "# HELP clipsim_history_entries Entries in history.\n");
+    fprintf(stream, "# TYPE clipsim_history_entries gauge\n");
+    fprintf(stream, "clipsim_history_entries %d\n", entries);
+    fprintf(stream, "# HELP clipsim_content_bytes "
+                    "Memory used by entry contents and previews.\n");
+    fprintf(stream, "# TYPE clipsim_content_bytes gauge\n");
+    fprintf(stream, "clipsim_content_bytes %zu\n", content);
+    fprintf(stream, "# HELP clipsim_slab_bytes Memory mapped for slabs.\n");
+    fprintf(stream, "# TYPE clipsim_slab_bytes gauge\n");
+    fprintf(stream, "clipsim_slab_bytes %zu\n", slabs);
+    fprintf(stream, "# HELP clipsim_resident_bytes Resident set size.\n");
+    fprintf(stream, "# TYPE clipsim_resident_bytes gauge\n");
+    fprintf(stream, "clipsim_resident_bytes %zu\n", resident);
+    fprintf(stream, "# HELP clipsim_uptime_seconds "
+                    "Time since the daemon started.\n");
+    fprintf(stream, "# TYPE clipsim_uptime_seconds gauge\n");
+    fprintf(stream, "clipsim_uptime_seconds %lu\n", uptime);
+    return;
+}
@@ -0,0 +1,355 @@
+/* This file is part of clipsim.
+ * Copyright (C) 2023 Lucas Mior
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "clipsim.h"
+
+/* Every text entry gets a document number when it is added, and each
+ * trigram of its content (three consecutive bytes) has a posting list of
+ * the documents containing it. Document numbers only grow, so postings
+ * are appended in order and stay sorted for intersection. A removed
+ * entry only clears its document; once there are more dead documents
+ * than live ones, the live ones are numbered again and postings are
+ * filtered, in O(postings).
+ *
+ * Entries longer than TRIGRAM_MAX_LENGTH are not split in trigrams,
+ * they are kept apart and checked by every query. */
+#define TRIGRAM_MIN_TABLE 4096
+#define TRIGRAM_MIN_POSTING 4
+#define TRIGRAM_MIN_DEAD 1024
+#define TRIGRAM_MAX_LENGTH (1 << 20)
+#define TRIGRAM_EMPTY UINT32_MAX
+
+typedef struct Posting {
+    uint32 key;
+    int32 count;
+    int32 capacity;
+    int32 last;
+    int32 *documents;
+} Posting;
+
+static Posting *table = NULL;
+static usize table_size = 0;
+static usize table_used = 0;
+static Entry **documents = NULL;
+static int32 documents_size = 0;
+static int32 documents_count = 0;
+static int32 dead = 0;
+static Posting unindexed = { .key = TRIGRAM_EMPTY };
+
+static uint32 trigram_key(const char *);
+static usize trigram_hash(const uint32);
+static Posting *trigram_posting(const uint32, const bool);
+static void trigram_table_resize(const usize);
+static void trigram_push(Posting *, const int32);
+static void trigram_compact(void);
+static void trigram_filter(Posting *, const int32 *);
+static int trigram_compare_count(const void *, const void *);
+static int trigram_compare_id(const void *, const void *);
+static int32 trigram_intersect(int32 *, int32, const Posting *);
+
+uint32
+trigram_key(const char *p) {
+    const uchar *u = (const uchar *) p;
+    return ((uint32) u[0] << 16) | ((uint32) u[1] << 8) | (uint32) u[2];
+}
+
+usize
+trigram_hash(const uint32 key) {
+    uint32 h = key*0x9e3779b1u;
+    return h ^ (h >> 15);
+}
+
+/* Open addressing on the 24 bit key, NULL if absent and !create. */
+Posting *
+trigram_posting(const uint32 key, const bool create) {
+    usize mask;
+    usize i;
+
+    if (table_size == 0) {
+        if (!create)
+            return NULL;
+        trigram_table_resize(TRIGRAM_MIN_TABLE);
+    }
+
+    mask = table_size - 1;
+    for (i = trigram_hash(key) & mask; table[i].key != TRIGRAM_EMPTY;
+         i = (i + 1) & mask) {
+        if (table[i].key == key)
+            return &table[i];
+    }
+    if (!create)
+        return NULL;
+
+    /* keep the load under 1/2 */
+    if ((table_used + 1)*2 > table_size) {
+        trigram_table_resize(table_size*2);
+        return trigram_posting(key, create);
+    }
+    table[i].key = key;
+    table_used += 1;
+    return &table[i];
+}
+
+void
+trigram_table_resize(const usize size) {
+    DEBUG_PRINT("%zu", size);
+    Posting *old = table;
+    usize old_size = table_size;
+
+    table = util_malloc(size*sizeof (*table));
+    table_size = size;
+    for (usize i = 0; i < size; i += 1) {
+        table[i] = (Posting) { .key = TRIGRAM_EMPTY };
+    }
+
+    for (usize i = 0; i < old_size; i += 1) {
+        usize j;
+        if (old[i].key == TRIGRAM_EMPTY)
+            continue;
+        j = trigram_hash(old[i].key) & (size - 1);
+        while (table[j].key != TRIGRAM_EMPTY)
+            j = (j + 1) & (size - 1);
+        table[j] = old[i];
+    }
+    free(old);
+    return;
+}
+
+void
+trigram_push(Posting *posting, const int32 document) {
+    if (posting->count == posting->capacity) {
+        posting->capacity = MAX(posting->capacity*2, TRIGRAM_MIN_POSTING);
+        posting->documents = util_realloc(posting->documents,
+                                          (usize) posting->capacity
+                                          *sizeof (*(posting->documents)));
+    }
+    posting->documents[posting->count] = document;
+    posting->count += 1;
+    posting->last = document;
+    return;
+}
+
+/* Called for every new entry. Images are not indexed. */
+void
+trigram_add(Entry *e) {
+    DEBUG_PRINT("%p", (void *) e);
+    int32 document;
+
+    e->document = -1;
+    if (e->image_path)
+        return;
+
+    if (documents_count == documents_size) {
+        documents_size = MAX(documents_size*2, HISTORY_BUFFER_SIZE);
+        documents = util_realloc(documents,
+                                 (usize) documents_size*sizeof (*documents));
+    }
+    document = documents_count;
+    documents[document] = e;
+    documents_count += 1;
+    e->document = document;
+
+    if (e->content_length > TRIGRAM_MAX_LENGTH) {
+        trigram_push(&unindexed, document);
+        return;
+    }
+    for (int i = 0; i + 2 < e->content_length; i += 1) {
+        Posting *posting = trigram_posting(trigram_key(&e->content[i]), true);
+        /* the same trigram again in this entry */
+        if (posting->count && (posting->last == document))
+            continue;
+        trigram_push(posting, document);
+    }
+    return;
+}
+
+/* Called before an entry is freed. */
+void
+trigram_remove(Entry *e) {
+    DEBUG_PRINT("%p", (void *) e);
+    if (e->document < 0)
+        return;
+
+    documents[e->document] = NULL;
+    e->document = -1;
+    dead += 1;
+    if ((dead >= TRIGRAM_MIN_DEAD) && (dead*2 > documents_count))
+        trigram_compact();
+    return;
+}
+
+/* Number live documents 0..n-1, keeping their order, so postings only
+ * have to be filtered and stay sorted. */
+void
+trigram_compact(void) {
+    DEBUG_PRINT("void");
+    int32 *renumber = util_malloc((usize) documents_count*sizeof (*renumber));
+    int32 live = 0;
+
+    for (int32 d = 0; d < documents_count; d += 1) {
+        if (documents[d] == NULL) {
+            renumber[d] = -1;
+            continue;
+        }
+        renumber[d] = live;
+        documents[live] = documents[d];
+        documents[live]->document = live;
+        live += 1;
+    }
+
+    for (usize i = 0; i < table_size; i += 1) {
+        if (table[i].key != TRIGRAM_EMPTY)
+            trigram_filter(&table[i], renumber);
+    }
+    trigram_filter(&unindexed, renumber);
+
+    free(renumber);
+    documents_count = live;
+    dead = 0;
+    return;
+}
+
+void
+trigram_filter(Posting *posting, const int32 *renumber) {
+    int32 count = 0;
+
+    for (int32 i = 0; i < posting->count; i += 1) {
+        int32 d = renumber[posting->documents[i]];
+        if (d >= 0)
+            posting->documents[count++] = d;
+    }
+    posting->count = count;
+    if (count)
+        posting->last = posting->documents[count - 1];
+    if ((count == 0) && posting->capacity) {
+        free(posting->documents);
+        posting->documents = NULL;
+        posting->capacity = 0;
+    }
+    return;
+}
+
+void
+trigram_close(void) {
+    DEBUG_PRINT("void");
+    for (usize i = 0; i < table_size; i += 1)
+        free(table[i].documents);
+    free(table);
+    free(documents);
+    free(unindexed.documents);
+    table = NULL;
+    table_size = table_used = 0;
+    documents = NULL;
+    documents_size = documents_count = dead = 0;
+    unindexed = (Posting) { .key = TRIGRAM_EMPTY };
+    return;
+}
+
+int
+trigram_compare_count(const void *a, const void *b) {
+    const Posting *x = *(const Posting * const *) a;
+    const Posting *y = *(const Posting * const *) b;
+    return (x->count > y->count) - (x->count < y->count);
+}
+
+/* Newest first. */
+int
+trigram_compare_id(const void *a, const void *b) {
+    int32 x = *(const int32 *) a;
+    int32 y = *(const int32 *) b;
+    return (x < y) - (x > y);
+}
+
+/* Keep the candidates that are also in posting. Both are sorted and
+ * candidates is the shorter, so each one is searched with a binary
+ * search starting past the previous hit. */
+int32
+trigram_intersect(int32 *candidates, int32 count, const Posting *posting) {
+    int32 kept = 0;
+    int32 low = 0;
+
+    for (int32 i = 0; i < count; i += 1) {
+        int32 high = posting->count;
+        while (low < high) {
+            int32 middle = low + (high - low) / 2;
+            if (posting->documents[middle] < candidates[i])
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        if (low == posting->count)
+            break;
+        if (posting->documents[low] == candidates[i])
+            candidates[kept++] = candidates[i];
+    }
+    return kept;
+}
+
+/* Put in ids, which must have room for every entry, the ids of the text
+ * entries that can contain pattern, newest first. Called with lock held,
+ * the caller checks the candidates against their content without it.
+ * Returns -1 when every text entry is one, for patterns shorter than a
+ * trigram. */
+int32
+trigram_find(const char *pattern, const usize length, int32 *ids) {
+    DEBUG_PRINT("%s, %zu, %p", pattern, length, (void *) ids);
+    Posting *postings[SEARCH_QUERY_MAX];
+    int32 npostings = 0;
+    int32 *candidates;
+    int32 count = 0;
+    int32 found = 0;
+    bool missing = false;
+
+    if (length < 3)
+        return -1;
+
+    candidates = util_malloc((usize) MAX(documents_count, 1)*sizeof (*candidates));
+
+    for (usize i = 0; (i + 2 < length) && (npostings < SEARCH_QUERY_MAX); i += 1) {
+        Posting *posting = trigram_posting(trigram_key(&pattern[i]), false);
+        if ((posting == NULL) || (posting->count == 0)) {
+            missing = true;
+            break;
+        }
+        postings[npostings++] = posting;
+    }
+
+    if (!missing) {
+        qsort(postings, (usize) npostings, sizeof (*postings),
+              trigram_compare_count);
+        count = postings[0]->count;
+        memcpy(candidates, postings[0]->documents,
+               (usize) count*sizeof (*candidates));
+        for (int32 i = 1; (i < npostings) && count; i += 1) {
+            if (postings[i] != postings[i - 1])
+                count = trigram_intersect(candidates, count, postings[i]);
+        }
+    }
+    /* postings are disjoint from the unindexed documents */
+    for (int32 i = 0; i < unindexed.count; i += 1)
+        candidates[count++] = unindexed.documents[i];
+
+    for (int32 i = 0; i < count; i += 1) {
+        Entry *e = documents[candidates[i]];
+        if (e)
+            ids[found++] = history_entry_id(e);
+    }
+    free(candidates);
+
+    qsort(ids, (usize) found, sizeof (*ids), trigram_compare_id);
+    return found;
+}
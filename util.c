@@ -15,9 +15,37 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/sendfile.h>
+
 #include "clipsim.h"
 #include <stdarg.h>
 
+/* Entry content and previews are carved from 64 KiB slabs, one list of
+ * partially used slabs per power of two size class. Slabs are aligned to
+ * their size, so the header of the slab owning a block is found by
+ * masking its address, and a slab is unmapped as soon as its last block
+ * is freed. Not thread safe: callers hold the history lock. */
+#define SLAB_SIZE (64*1024)
+#define SLAB_MIN_SHIFT 4
+#define SLAB_CLASSES 9
+
+typedef struct Slab {
+    struct Slab *prev;
+    struct Slab *next;
+    void *free_list;
+    uint32 size;
+    uint32 used;
+    uint32 carved;
+    uint32 capacity;
+} Slab;
+
+static Slab *partial[SLAB_CLASSES];
+static usize slab_mapped = 0;
+
+static int util_slab_class(const usize);
+static Slab *util_slab_new(const int);
+static void util_slab_unlink(Slab *, const int);
+
 void *
 util_malloc(const usize size) {
     void *p;
@@ -71,6 +99,144 @@ util_calloc(const usize nmemb, const usize size) {
     return p;
 }
 
+int
+util_slab_class(const usize size) {
+    int class = 0;
+
+    while (((usize) 1 << (class + SLAB_MIN_SHIFT)) < size)
+        class += 1;
+    return class;
+}
+
+Slab *
+util_slab_new(const int class) {
+    char *map;
+    char *slab;
+    usize head;
+
+    /* map twice the size and trim it down to an aligned slab */
+    map = mmap(NULL, SLAB_SIZE*2, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        error("Error mapping slab: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    slab = (char *) (((uintptr_t) map + SLAB_SIZE - 1)
+                     & ~((uintptr_t) SLAB_SIZE - 1));
+    head = (usize) (slab - map);
+    if (head)
+        munmap(map, head);
+    munmap(slab + SLAB_SIZE, SLAB_SIZE - head);
+    slab_mapped += SLAB_SIZE;
+
+    {
+        Slab *s = (Slab *) slab;
+        uint32 size = 1u << (class + SLAB_MIN_SHIFT);
+        s->prev = NULL;
+        s->next = NULL;
+        s->free_list = NULL;
+        s->size = size;
+        s->used = 0;
+        s->carved = 0;
+        s->capacity = (SLAB_SIZE - sizeof (*s)) / size;
+        return s;
+    }
+}
+
+void
+util_slab_unlink(Slab *s, const int class) {
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        partial[class] = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    s->prev = s->next = NULL;
+    return;
+}
+
+/* Blocks larger than the biggest size class come from malloc. */
+void *
+util_slab_alloc(const usize size) {
+    int class;
+    Slab *s;
+    void *p;
+
+    if (size > UTIL_SLAB_MAX)
+        return util_malloc(size);
+
+    class = util_slab_class(size);
+    if ((s = partial[class]) == NULL)
+        s = partial[class] = util_slab_new(class);
+
+    if (s->free_list) {
+        p = s->free_list;
+        memcpy(&(s->free_list), p, sizeof (s->free_list));
+    } else {
+        p = (char *) (s + 1) + (usize) s->carved*s->size;
+        s->carved += 1;
+    }
+    s->used += 1;
+
+    if (s->used == s->capacity)
+        util_slab_unlink(s, class);
+    return p;
+}
+
+/* size must be the one given to util_slab_alloc. */
+void
+util_slab_free(void *p, const usize size) {
+    int class;
+    Slab *s;
+
+    if (p == NULL)
+        return;
+    if (size > UTIL_SLAB_MAX) {
+        free(p);
+        return;
+    }
+
+    class = util_slab_class(size);
+    s = (Slab *) ((uintptr_t) p & ~((uintptr_t) SLAB_SIZE - 1));
+
+    if (s->used == s->capacity) {
+        s->next = partial[class];
+        if (s->next)
+            s->next->prev = s;
+        partial[class] = s;
+    }
+    memcpy(p, &(s->free_list), sizeof (s->free_list));
+    s->free_list = p;
+    s->used -= 1;
+
+    /* keep one slab around so that a single block does not thrash */
+    if ((s->used == 0) && ((s != partial[class]) || s->next)) {
+        util_slab_unlink(s, class);
+        munmap(s, SLAB_SIZE);
+        slab_mapped -= SLAB_SIZE;
+    }
+    return;
+}
+
+/* Move a malloc'ed block into a slab, if it fits one. */
+void *
+util_slab_move(void *p, const usize size) {
+    void *q;
+
+    if (size > UTIL_SLAB_MAX)
+        return p;
+
+    q = util_slab_alloc(size);
+    memcpy(q, p, size);
+    free(p);
+    return q;
+}
+
+usize
+util_slab_mapped(void) {
+    return slab_mapped;
+}
+
 int
 util_string_int32(int32 *number, const char *string) {
     char *endptr;
@@ -87,6 +253,41 @@ util_string_int32(int32 *number, const char *string) {
     }
 }
 
+/* 64-bit multiply-rotate hash over 8 byte words, finished with the
+ * murmur3 avalanche. Not cryptographic, but good enough to identify
+ * clipboard content without comparing it. */
+uint64
+util_hash(const void *data, const usize length) {
+    const uchar *p = data;
+    const uint64 k1 = 0x87c37b91114253d5ull;
+    const uint64 k2 = 0x4cf5ad432745937full;
+    uint64 h = 0x9e3779b97f4a7c15ull ^ (length*k1);
+    usize i = 0;
+
+    for (; i + 8 <= length; i += 8) {
+        uint64 w;
+        memcpy(&w, p + i, sizeof (w));
+        w *= k1;
+        w = (w << 31) | (w >> 33);
+        h ^= w*k2;
+        h = ((h << 27) | (h >> 37))*5 + 0x52dce729;
+    }
+    if (i < length) {
+        uint64 w = 0;
+        memcpy(&w, p + i, length - i);
+        w *= k1;
+        w = (w << 31) | (w >> 33);
+        h ^= w*k2;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
 void
 util_die_notify(const char *format, ...) {
     char *notifiers[2] = { "dunstify", "notify-send" };
@@ -154,55 +355,203 @@ util_open(File *file, const int flag) {
     }
 }
 
-int
-util_copy_file(const char *destination, const char *source) {
-    int source_fd, destination_fd;
+/* Copies from the current offsets until the end of source, length being
+ * a hint, 0 for none. Returns the number of bytes copied or -1. */
+isize
+util_copy_range(const int destination, const int source, usize length) {
     char buffer[BUFSIZ];
-    isize r = 0;
-    isize w = 0;
-    
-    if ((source_fd = open(source, O_RDONLY)) < 0) {
-        error("Error opening %s for reading: %s\n", 
-                        source, strerror(errno));
+    isize copied = 0;
+    isize r;
+
+    if (length == 0)
+        length = SSIZE_MAX;
+    while ((r = copy_file_range(source, NULL, destination, NULL,
+                                length, 0)) > 0) {
+        copied += r;
+    }
+    if (r == 0)
+        return copied;
+    if ((errno != EXDEV) && (errno != EINVAL) && (errno != ENOSYS)
+        && (errno != EOPNOTSUPP)) {
         return -1;
     }
 
-    if ((destination_fd = open(destination, O_WRONLY | O_CREAT | O_TRUNC, 
-                                            S_IRUSR | S_IWUSR)) < 0) {
-        error("Error opening %s for writing: %s\n",
-                         destination, strerror(errno));
-        close(source_fd);
+    while ((r = sendfile(destination, source, NULL, length)) > 0)
+        copied += r;
+    if (r == 0)
+        return copied;
+    if ((errno != EINVAL) && (errno != ENOSYS))
         return -1;
-    }
 
-    errno = 0;
-    while ((r = read(source_fd, buffer, BUFSIZ)) > 0) {
-        w = write(destination_fd, buffer, (usize) r);
-        if (w != r) {
-            fprintf(stderr, "Error writing data to %s", destination);
-            if (errno)
-                fprintf(stderr, ": %s", strerror(errno));
-            fprintf(stderr, ".\n");
-
-            close(source_fd);
-            close(destination_fd);
+    while ((r = read(source, buffer, sizeof (buffer))) > 0) {
+        if (!util_write_all(destination, buffer, (usize) r))
             return -1;
+        copied += r;
+    }
+    return r < 0 ? -1 : copied;
+}
+
+/* Moves length bytes from in to out, through a kernel pipe buffer when
+ * one of them is a pipe. */
+bool
+util_splice(const int in, const int out, usize length) {
+    char buffer[BUFSIZ];
+    isize r = 0;
+
+    while ((length > 0)
+           && ((r = splice(in, NULL, out, NULL, MIN(length, UTIL_SPLICE_SIZE),
+                           SPLICE_F_MOVE | SPLICE_F_MORE)) > 0)) {
+        length -= (usize) r;
+    }
+    if (length == 0)
+        return true;
+    if ((r == 0) || (errno != EINVAL))
+        return false;
+
+    while ((length > 0)
+           && ((r = read(in, buffer, MIN(length, sizeof (buffer)))) > 0)) {
+        if (!util_write_all(out, buffer, (usize) r))
+            return false;
+        length -= (usize) r;
+    }
+    return length == 0;
+}
+
+bool
+util_write_all(const int fd, const void *data, usize length) {
+    const char *p = data;
+
+    while (length > 0) {
+        isize w = write(fd, p, length);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
         }
+        p += w;
+        length -= (usize) w;
     }
+    return true;
+}
+
+/* iov is modified as it is written. */
+bool
+util_writev_all(const int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        isize w = writev(fd, iov, MIN(count, IOV_MAX));
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        while ((count > 0) && ((usize) w >= iov->iov_len)) {
+            w -= (isize) iov->iov_len;
+            iov += 1;
+            count -= 1;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + w;
+            iov->iov_len -= (usize) w;
+        }
+    }
+    return true;
+}
 
-    if (r < 0) {
-        error("Error reading data from %s: %s\n",
-                        source, strerror(errno));
-        close(source_fd);
-        close(destination_fd);
+/* Open file->name for writing so that it only shows up, complete, when
+ * util_create_commit() is called: as an unnamed O_TMPFILE in the same
+ * directory, or <name>.tmp where that is not supported. */
+int
+util_create_open(File *file) {
+    char directory[PATH_MAX];
+    char temp[PATH_MAX];
+    char *slash;
+
+    if (snprintf(directory, sizeof (directory), "%s", file->name)
+        >= (int) sizeof (directory)) {
+        error("Path too long: %s\n", file->name);
         return -1;
     }
+    if ((slash = strrchr(directory, '/')))
+        *slash = '\0';
+    else
+        strcpy(directory, ".");
 
-    close(source_fd);
-    close(destination_fd);
+    file->anonymous = true;
+    if ((file->fd = open(directory, O_TMPFILE | O_WRONLY | O_CLOEXEC,
+                                    S_IRUSR | S_IWUSR)) >= 0) {
+        return 0;
+    }
+
+    file->anonymous = false;
+    if (snprintf(temp, sizeof (temp), "%s.tmp", file->name)
+        >= (int) sizeof (temp)) {
+        error("Path too long: %s\n", file->name);
+        return -1;
+    }
+    if ((file->fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                               S_IRUSR | S_IWUSR)) < 0) {
+        error("Error opening %s for writing: %s\n", temp, strerror(errno));
+        return -1;
+    }
     return 0;
 }
 
+/* Sync the data and give it its name, replacing any file there. The
+ * file stays open. */
+bool
+util_create_commit(File *file) {
+    if (fdatasync(file->fd) < 0) {
+        error("Error syncing %s: %s\n", file->name, strerror(errno));
+        return false;
+    }
+    return util_create_link(file);
+}
+
+/* Like util_create_commit(), for a caller that syncs the data itself
+ * before anything durable refers to the name. */
+bool
+util_create_link(File *file) {
+    char temp[PATH_MAX];
+    char self[32];
+
+    snprintf(temp, sizeof (temp), "%s.tmp", file->name);
+
+    if (file->anonymous) {
+        snprintf(self, sizeof (self), "/proc/self/fd/%d", file->fd);
+        if (linkat(AT_FDCWD, self, AT_FDCWD, file->name,
+                   AT_SYMLINK_FOLLOW) == 0) {
+            return true;
+        }
+        /* linkat() does not replace, go through a temporary name */
+        if ((errno != EEXIST)
+            || ((unlink(temp) < 0) && (errno != ENOENT))
+            || (linkat(AT_FDCWD, self, AT_FDCWD, temp, AT_SYMLINK_FOLLOW) < 0)) {
+            error("Error linking %s: %s\n", file->name, strerror(errno));
+            return false;
+        }
+    }
+    if (rename(temp, file->name) < 0) {
+        error("Error renaming %s to %s: %s\n",
+              temp, file->name, strerror(errno));
+        unlink(temp);
+        return false;
+    }
+    return true;
+}
+
+/* Close a file from util_create_open() that was not committed. */
+void
+util_create_abort(File *file) {
+    char temp[PATH_MAX];
+
+    if (!file->anonymous) {
+        snprintf(temp, sizeof (temp), "%s.tmp", file->name);
+        unlink(temp);
+    }
+    util_close(file);
+    return;
+}
+
 void error(char *format, ...) {
     int n;
     va_list args;